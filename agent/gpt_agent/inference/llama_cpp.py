@@ -57,7 +57,8 @@ def _start_request(token_ids: list[int], temperature: float):
         print("Token generation thread ending.")
 
 
-    avllm.set_prompt(token_ids)
+    n_reused = avllm.set_prompt(token_ids)
+    print(f"Reused {n_reused} of {len(token_ids)} prompt tokens")
     t = threading.Thread(target=run, name="-stream", daemon=True)
     t.start()
     return t
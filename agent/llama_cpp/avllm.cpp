@@ -7,6 +7,7 @@
 #include "log.hpp"
 #include "sampling.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
@@ -170,12 +171,53 @@ struct model_general_t
 
     bool is_initialized() const { return initialized; }
 
+    // decode the prompt on top of what the context already holds: keep the
+    // common prefix, trim the rest of the KV and decode only the delta.
+    // return the number of reused tokens
+    int decode_prompt(const std::vector<llama_token> & prompt_tokens)
+    {
+        llama_context * ctx = ctx_ptr.get();
+        llama_memory_t mem  = llama_get_memory(ctx);
+
+        size_t n_keep = 0;
+        size_t n_max  = std::min(decoded_tokens.size(), prompt_tokens.size());
+        while (n_keep < n_max && decoded_tokens[n_keep] == prompt_tokens[n_keep])
+            n_keep++;
+        // at least one token is decoded to get the logits
+        if (n_keep == prompt_tokens.size() && n_keep > 0)
+            n_keep--;
+
+        if (!llama_memory_seq_rm(mem, 0, n_keep, -1))
+        {
+            llama_memory_clear(mem, true);
+            n_keep = 0;
+        }
+        decoded_tokens.resize(n_keep);
+
+        std::vector<llama_token> delta(prompt_tokens.begin() + n_keep, prompt_tokens.end());
+        if (delta.empty())
+            return n_keep;
+
+        llama_batch batch = llama_batch_get_one(delta.data(), delta.size());
+        if (llama_decode(ctx, batch))
+        {
+            AVLLM_LOG_ERROR("%s: error: failed to decode the prompt\n", __func__);
+            llama_memory_clear(mem, true);
+            decoded_tokens.clear();
+            return 0;
+        }
+        decoded_tokens.insert(decoded_tokens.end(), delta.begin(), delta.end());
+
+        return n_keep;
+    }
+
     llama_model_ptr model_ptr                    = nullptr;
     common_chat_templates_ptr chat_templates_ptr = nullptr;
     llama_sampler_ptr sampler_default_ptr        = nullptr;
     std::string model_path;
     bool initialized = false;
     llama_context_ptr ctx_ptr;
+    std::vector<llama_token> decoded_tokens; // tokens held in the KV
 
 } model_general;
 
@@ -220,7 +262,7 @@ void av_llm_init(const char * model_path_)
     model_general.init(model_path_);
 }
 
-void av_llm_set_prompt(std::vector<int32_t> _prompt_tokens)
+int av_llm_set_prompt(std::vector<int32_t> _prompt_tokens)
 {
     AVLLM_LOG_TRACE_SCOPE(av_llm::string_format("%s - token-size: %d", __FUNCTION__, _prompt_tokens.size()).c_str())
 
@@ -241,7 +283,7 @@ void av_llm_set_prompt(std::vector<int32_t> _prompt_tokens)
             if (n < 0)
             {
                 AVLLM_LOG_ERROR("%s: error: failed to tokenize \n", __func__);
-                return;
+                return 0;
             }
             std::string s(buf, n);
             std::cout << s;
@@ -252,20 +294,18 @@ void av_llm_set_prompt(std::vector<int32_t> _prompt_tokens)
     if (!model_general.is_initialized())
     {
         AVLLM_LOG_ERROR("%s: error: model is not initialized\n", __func__);
-        return;
+        return 0;
     }
 
     if (!ctx)
     {
         AVLLM_LOG_ERROR("%s: error: context is not initialized\n", __func__);
-        return;
+        return 0;
     }
 
-    {
-        llama_memory_clear(llama_get_memory(ctx), true);
-        llama_batch batch = llama_batch_get_one(_prompt_tokens.data(), _prompt_tokens.size());
-        llama_decode(ctx, batch);
-    }
+    int n_reused = model_general.decode_prompt(_prompt_tokens);
+    AVLLM_LOG_DEBUG("%s: reused %d of %zu tokens\n", __func__, n_reused, _prompt_tokens.size());
+    return n_reused;
 }
 
 int av_llm_get_next_token()
@@ -292,7 +332,8 @@ int av_llm_get_next_token()
     }
     {
         llama_batch batch = llama_batch_get_one(&new_token, 1);
-        llama_decode(ctx, batch);
+        if (llama_decode(ctx, batch) == 0)
+            model_general.decoded_tokens.push_back(new_token);
     }
 
     return new_token;
@@ -5,7 +5,7 @@
 
 extern "C" {
 void av_llm_init(const char* model_path);
-void av_llm_set_prompt(std::vector<int32_t> prompt_tokens);
+int av_llm_set_prompt(std::vector<int32_t> prompt_tokens);
 int av_llm_get_next_token();
 void av_llm_debug(std::vector<int32_t> debug_tokens);
 }
@@ -22,15 +22,16 @@ PYBIND11_MODULE(avllm, m) {
 
   m.def(
       "set_prompt",
-      [](const std::vector<int32_t>& prompt_tokens) {
+      [](const std::vector<int32_t>& prompt_tokens) -> int {
         try {
-          av_llm_set_prompt(prompt_tokens);
+          return av_llm_set_prompt(prompt_tokens);
         } catch (const std::exception& e) {
           std::cerr << "Exception in set_prompt: " << e.what() << std::endl
                     << std::flush;
         }
+        return 0;
       },
-      "Set the prompt tokens for LLM");
+      "Set the prompt tokens for LLM, return the number of reused tokens");
 
   m.def("get_next_token", &av_llm_get_next_token,
         "Get the next token from LLM");
@@ -18,6 +18,7 @@ namespace av_llm {
 
 #include <CLI/CLI.hpp>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <ctime>
@@ -35,6 +36,9 @@ namespace av_llm {
 #include <unordered_map>
 #include <vector>
 
+#include "chat_prompt.hpp"
+#include "scheduler.hpp"
+#include "token_cache.hpp"
 #include "utils.hpp"
 
 #ifdef _WIN32
@@ -192,6 +196,20 @@ int main(int argc, char **argv) {
   // context
   app.add_option("--ctx", xoptions_.n_ctx, "Number of context")
       ->default_val(std::to_string(xoptions_.n_ctx));
+  app.add_option("--ctx-overflow", xoptions_.ctx_overflow,
+                 "When the context is full: shift (discard the oldest "
+                 "tokens), truncate-prompt or error")
+      ->check(CLI::IsMember({"shift", "truncate-prompt", "error"}))
+      ->default_val(xoptions_.ctx_overflow);
+  app.add_option("--ctx-keep", xoptions_.n_keep,
+                 "Number of tokens kept at the start of the context on "
+                 "overflow")
+      ->default_val(std::to_string(xoptions_.n_keep));
+  app.add_option("--ctx-discard", xoptions_.ctx_discard,
+                 "Fraction of the tokens after --ctx-keep discarded on "
+                 "overflow")
+      ->check(CLI::Range(0.0, 1.0))
+      ->default_val(std::to_string(xoptions_.ctx_discard));
   app.add_option("--n_batch", xoptions_.n_batch, "Number of batch")
       ->default_val(std::to_string(xoptions_.n_batch));
   app.add_option("--n_ubatch", xoptions_.n_ubatch, "Number of batch")
@@ -233,16 +251,71 @@ int main(int argc, char **argv) {
   auto chat = app.add_subcommand("chat", "Start an interactive chat");
   chat->add_option("url-or-alias", xoptions_.model_url_or_alias, "Model path")
       ->required();
+  chat->add_option("--session", xoptions_.session_file,
+                   "File of the conversation KV, restored at start and saved "
+                   "after each answer");
 
   // ---- SERVE command ----
   auto serve = app.add_subcommand("serve", "Serve model");
   serve->add_option("-p,--port", xoptions_.port, "Serve port");
   serve->add_option("--np", xoptions_.n_parallel,
                     "Number of parallel requests");
+  serve->add_option("--max-queue", xoptions_.n_queue_max,
+                    "Maximum number of waiting requests, 0 is unlimited")
+      ->default_val(std::to_string(xoptions_.n_queue_max));
   serve->add_option("--emb-model", xoptions_.model_path_emb,
                     "Embedding Model path");
+  serve->add_option("--emb-np", xoptions_.n_parallel_emb,
+                    "Number of pooled embedding contexts")
+      ->default_val(std::to_string(xoptions_.n_parallel_emb));
+  serve->add_option("--emb-batch-ms", xoptions_.emb_batch_ms,
+                    "Window to coalesce embedding requests, 0 disables it")
+      ->default_val(std::to_string(xoptions_.emb_batch_ms));
+  serve->add_option("--stream-flush-ms", xoptions_.stream_flush_ms,
+                    "Max latency to batch streamed tokens per write, 0: "
+                    "write each token")
+      ->default_val(std::to_string(xoptions_.stream_flush_ms));
+  serve->add_option("--stream-flush-bytes", xoptions_.stream_flush_bytes,
+                    "Buffered bytes of streamed tokens written at once, with "
+                    "--stream-flush-ms")
+      ->default_val(std::to_string(xoptions_.stream_flush_bytes));
+  serve->add_option("--draft-model", xoptions_.model_path_draft,
+                    "Draft model path for speculative decoding");
+  serve->add_flag("--session-cache", xoptions_.session_cache,
+                  "Save the KV of a session (user / session_id) to disk when "
+                  "its slot is taken, restore it when the session returns");
+  serve->add_option("--kv-host-cache-mb", xoptions_.kv_host_cache_mb,
+                    "Host memory (MB) keeping the KV of prefixes evicted from "
+                    "their slot, 0 disables it")
+      ->check(CLI::NonNegativeNumber)
+      ->default_val(std::to_string(xoptions_.kv_host_cache_mb));
+  serve->add_option("--token-cache-min-len", xoptions_.token_cache_min_len,
+                    "Prompts of at least this many bytes have their tokens "
+                    "cached, shorter ones are tokenized every time")
+      ->default_val(std::to_string(xoptions_.token_cache_min_len));
+  serve->add_option("--kv-total", xoptions_.kv_total,
+                    "Cells of a KV shared by all the slots, each request "
+                    "still up to --ctx tokens. 0: --ctx cells per slot")
+      ->check(CLI::NonNegativeNumber)
+      ->default_val(std::to_string(xoptions_.kv_total));
+  serve->add_option("--draft-n", xoptions_.n_draft,
+                    "Number of tokens drafted per step (draft model or ngram)")
+      ->default_val(std::to_string(xoptions_.n_draft));
   serve->add_option("url-or-alias", xoptions_.model_url_or_alias, "Model path");
 
+  // KV cache
+  for (CLI::App *sub : {chat, serve}) {
+    sub->add_option("--cache-type-k", xoptions_.cache_type_k,
+                    "KV cache type of K: f16, q8_0, q4_0...")
+        ->check(CLI::IsMember(kv_cache_types))
+        ->default_val(xoptions_.cache_type_k);
+    sub->add_option("--cache-type-v", xoptions_.cache_type_v,
+                    "KV cache type of V, a quantized type enables flash "
+                    "attention")
+        ->check(CLI::IsMember(kv_cache_types))
+        ->default_val(xoptions_.cache_type_v);
+  }
+
   // -- llama comand ----
   auto llama = app.add_subcommand("llama", "LLAMA server command");
   llama->allow_extras();
@@ -383,10 +456,9 @@ static void chat_cmd_handler(std::filesystem::path model_path) {
 
   // context initialize
   llama_context_ptr ctx = [&model]() -> llama_context_ptr {
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.no_perf = false;
-    ctx_params.n_ctx = xoptions_.n_ctx;
-    ctx_params.n_batch = xoptions_.n_batch;
+    llama_context_params ctx_params =
+        llama_context_params_from_xoptions(xoptions_);
+    kv_cache_print(model.get(), ctx_params);
     return llama_context_ptr(llama_init_from_model(model.get(), ctx_params));
   }();
   if (!ctx) {
@@ -419,16 +491,39 @@ static void chat_cmd_handler(std::filesystem::path model_path) {
                     __func__);
     return;
   }
+  // vocab -> piece, once per model
+  const piece_table pieces(llama_model_get_vocab(model.get()));
+
   std::vector<llama_chat_message> chat_messages;
   std::vector<char> chat_message_output(llama_n_ctx(ctx.get()));
   int chat_message_start = 0;
   int chat_message_end = 0;
 
+  // --session: the KV of the conversation, a restored one goes on with the
+  // next user message
+  std::vector<llama_token> session_tokens;
+  if (!xoptions_.session_file.empty() &&
+      std::filesystem::exists(xoptions_.session_file)) {
+    session_tokens.resize(llama_n_ctx(ctx.get()));
+    size_t n_token = 0;
+    if (llama_state_seq_load_file(ctx.get(), xoptions_.session_file.c_str(), 0,
+                                  session_tokens.data(), session_tokens.size(),
+                                  &n_token) == 0) {
+      AVLLM_LOG_WARN("%s: unable to restore the session %s\n", __func__,
+                     xoptions_.session_file.c_str());
+      llama_memory_seq_rm(llama_get_memory(ctx.get()), 0, -1, -1);
+      n_token = 0;
+    }
+    session_tokens.resize(n_token);
+    if (n_token > 0)
+      AVLLM_LOG_INFO("%s: session restored, %zu tokens\n", __func__, n_token);
+  }
+
   while (true) {
     std::string input_msg;
     {  // get input string and apply template
 
-      bool is_sys = chat_messages.size() == 0;
+      bool is_sys = chat_messages.size() == 0 && session_tokens.empty();
       std::cout << "\n" << (is_sys ? "system >" : "user   >");
 
       std::getline(std::cin, input_msg);
@@ -465,13 +560,9 @@ static void chat_cmd_handler(std::filesystem::path model_path) {
 
     bool is_first =
         llama_memory_seq_pos_max(llama_get_memory(ctx.get()), 0) == -1;
-    int n_prompt_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(),
-                                          NULL, 0, is_first, true);
-    std::vector<llama_token> prompt_tokens(n_prompt_tokens);
-
-    if (llama_tokenize(vocab, prompt.data(), prompt.size(),
-                       prompt_tokens.data(), prompt_tokens.size(), is_first,
-                       true) < 0) {
+    std::vector<llama_token> prompt_tokens =
+        tokenize_text(vocab, prompt, is_first, true);
+    if (prompt_tokens.empty()) {
       AVLLM_LOG_ERROR("%s: failed to tokenize the prompt \n", __func__);
       return;
     }
@@ -480,53 +571,92 @@ static void chat_cmd_handler(std::filesystem::path model_path) {
       std::cout << "\ntokens: \n";
       int cnt = 0;
       for (auto token : prompt_tokens) {
-        char buf[120];
-        int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
-        if (n < 0) {
-          AVLLM_LOG_ERROR("%s: error: failed to tokenize \n", __func__);
-          return;
-        }
-        std::string s(buf, n);
-        std::cout << s;
+        std::cout << pieces.piece(token);
         cnt++;
       }
       std::cout << "end: " << cnt << "\n";
     }
 
+    ctx_overflow overflow = ctx_overflow_from_str(xoptions_.ctx_overflow);
+    if (overflow != ctx_overflow::error) {
+      // as the server does: the conversation is the prompt, its middle is
+      // cut when it doesn't fit. the KV is kept up to the cut
+      std::vector<llama_token> conversation = session_tokens;
+      conversation.insert(conversation.end(), prompt_tokens.begin(),
+                          prompt_tokens.end());
+      int n_erase =
+          truncate_prompt_tokens(conversation, llama_n_ctx(ctx.get()),
+                                 xoptions_.n_keep, xoptions_.ctx_discard);
+      if (n_erase > 0) {
+        size_t n_common = std::min(
+            slot_manager::common_prefix(session_tokens, conversation),
+            conversation.size() - 1);
+        llama_memory_seq_rm(llama_get_memory(ctx.get()), 0, n_common, -1);
+        session_tokens.resize(n_common);
+        prompt_tokens.assign(conversation.begin() + n_common,
+                             conversation.end());
+        AVLLM_LOG_INFO("%s: prompt truncated by %d tokens\n", __func__,
+                       n_erase);
+      }
+    }
+
     llama_batch batch =
         llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+    detokenizer detok(&pieces);
 
+    bool is_prompt = true;
     while (true) {
+      llama_memory_t mem = llama_get_memory(ctx.get());
       int n_ctx = llama_n_ctx(ctx.get());
-      int n_ctx_used =
-          llama_memory_seq_pos_max(llama_get_memory(ctx.get()), 0) + 1;
+      int n_ctx_used = llama_memory_seq_pos_max(mem, 0) + 1;
+
+      // the oldest turns make room, for the answer too: shift mode only
+      while (n_ctx_used + batch.n_tokens > n_ctx &&
+             overflow == ctx_overflow::shift) {
+        int n_keep = std::min(xoptions_.n_keep, n_ctx_used);
+        int n_discard = (n_ctx_used - n_keep) * xoptions_.ctx_discard;
+        if (n_discard <= 0 || !context_shift(mem, 0, n_keep, n_discard)) break;
+        n_ctx_used -= n_discard;
+        if (n_keep < (int)session_tokens.size())
+          session_tokens.erase(
+              session_tokens.begin() + n_keep,
+              session_tokens.begin() +
+                  std::min<size_t>(n_keep + n_discard, session_tokens.size()));
+        AVLLM_LOG_INFO("%s: discarded %d tokens of the context\n", __func__,
+                       n_discard);
+      }
 
       if (n_ctx_used + batch.n_tokens > n_ctx) {
         AVLLM_LOG_WARN("%s: the context is exceeded. \n", __func__);
-        return;
+        if (is_prompt || overflow == ctx_overflow::error) return;
+        std::cout << detok.flush();
+        break;  // the answer stops at the end of the context
       }
 
       if (int rc = llama_decode(ctx.get(), batch); rc) {
         AVLLM_LOG_ERROR("%s : failed to eval, return code %d\n", __func__, rc);
         return;
       }
+      is_prompt = false;
+      session_tokens.insert(session_tokens.end(), batch.token,
+                            batch.token + batch.n_tokens);
 
       new_token = llama_sampler_sample(smpl.get(), ctx.get(), -1);
       if (llama_vocab_is_eog(vocab, new_token)) {
+        std::cout << detok.flush();
         break;
       }
 
-      char buf[100];
-      int n = llama_token_to_piece(vocab, new_token, buf, sizeof(buf), 0, true);
-      if (n < 0) {
-        AVLLM_LOG_ERROR("%s, failed to convert a token \n", __func__);
-        return;
-      }
-
-      std::string out(buf, n);
-      std::cout << out;
+      std::cout << detok.push(new_token) << std::flush;
       batch = llama_batch_get_one(&new_token, 1);
     }
+
+    if (!xoptions_.session_file.empty() &&
+        llama_state_seq_save_file(ctx.get(), xoptions_.session_file.c_str(), 0,
+                                  session_tokens.data(),
+                                  session_tokens.size()) == 0)
+      AVLLM_LOG_WARN("%s: unable to save the session %s\n", __func__,
+                     xoptions_.session_file.c_str());
   }
 
   if (false) {
@@ -536,24 +666,46 @@ static void chat_cmd_handler(std::filesystem::path model_path) {
 
 };  // end of chat handler
 
-class session_chat_message : public http::base_data {
+// data of an av_connect session, released when the session is closed. the
+// flag tells the generations of the session that the client is gone
+class session_state : public http::base_data {
+ public:
+  ~session_state() { closed->store(true); }
+
+  std::shared_ptr<std::atomic<bool>> closed =
+      std::make_shared<std::atomic<bool>>(false);
+};
+
+static std::shared_ptr<std::atomic<bool>> session_closed_flag(
+    std::shared_ptr<http::response> &res) {
+  auto *state = dynamic_cast<session_state *>(res->session_data().get());
+  if (!state) {
+    res->session_data() = std::make_unique<session_state>();
+    state = static_cast<session_state *>(res->session_data().get());
+  }
+  return state->closed;
+}
+
+class session_chat_message : public session_state {
   std::vector<char> message;
   int start;
   int end;
 };
 
-// helper
-std::string model_oaicompact_to_text(const llama_model *model,
-                                     const nlohmann::ordered_json &oai_js) {
+// render the messages of the request with the chat templates of the model,
+// initialized once at load
+std::string model_oaicompact_to_text(const common_chat_templates *tmpls,
+                                     const nlohmann::ordered_json &oai_js,
+                                     bool add_generation_prompt = true) {
   std::string result;
 
-  const std::string str_messages = oai_js.at("messages").dump();
-
-  std::string bos_token = "";
-  std::string eos_token = "";
-
-  std::vector<common_chat_msg> messages =
-      common_chat_msgs_parse_oaicompat(str_messages);
+  std::vector<common_chat_msg> messages;
+  try {
+    messages = common_chat_msgs_parse_oaicompat(oai_js.at("messages"));
+  } catch (const std::exception &e) {
+    AVLLM_LOG_WARN("%s: invalid messages: %s\n", __func__, e.what());
+    return result;
+  }
 
   const std::string str_tools =
       json_value(oai_js, "tools", std::string());  // oai_js.at("tools").dump();
@@ -561,77 +713,107 @@ std::string model_oaicompact_to_text(const llama_model *model,
       str_tools.empty() ? std::vector<common_chat_tool>()
                         : common_chat_tools_parse_oaicompat(str_tools);
 
-  const auto add_generation_prompt = true;
-
   common_chat_templates_inputs inputs;
   inputs.use_jinja = xoptions_.jinja;
   inputs.messages = messages;
   inputs.add_generation_prompt = add_generation_prompt;
   inputs.tools = tools;
 
-  std::string template_jinja;
-  auto tmpls = common_chat_templates_init(model, template_jinja.c_str(),
-                                          bos_token, eos_token);
   try {
-    result = common_chat_templates_apply(tmpls.get(), inputs).prompt;
+    result = common_chat_templates_apply(tmpls, inputs).prompt;
   } catch (const std::exception &e) {
     AVLLM_LOG_WARN("%s: Chat template parsing error: %s\n", __func__, e.what());
   }
   return result;
 };
 
+// submit the prompt to the batch scheduler, it picks the slot, and wait until
+// the sequence ends
 int context_gen_text_until_eog(
-    llama_context *ctx, std::vector<llama_token> &prompt_tokens,
-    std::function<int(int, const std::string &)> func_, llama_sampler *smpl) {
-  llama_token new_token;
-  const llama_model *model = llama_get_model(ctx);
-  const llama_vocab *vocab = llama_model_get_vocab(model);
+    batch_scheduler &sched, std::vector<llama_token> &prompt_tokens,
+    std::function<int(int, const std::string &)> func_,
+    const gen_params &params = {}, gen_stats *stats = nullptr) {
+  return sched.generate(prompt_tokens, std::move(func_), params, stats);
+};
 
-  llama_batch batch =
-      llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+// n completions of one prompt: the prompt is decoded once, the sequences
+// fork from it and decode together. func_ gets the index of the completion,
+// stats points to n entries
+int context_gen_text_n(
+    batch_scheduler &sched, std::vector<llama_token> &prompt_tokens, int n,
+    std::function<int(int, int, const std::string &)> func_,
+    const gen_params &params = {}, gen_stats *stats = nullptr) {
+  return sched.generate_n(prompt_tokens, n, std::move(func_), params, stats);
+};
 
-  while (true) {
-    int n_ctx = llama_n_ctx(ctx);
-    int n_ctx_used = llama_memory_seq_pos_max(llama_get_memory(ctx), 0) + 1;
+// the indices of the n completions with the highest mean token log
+// probability (best_of)
+static std::vector<int> best_completions(const std::vector<gen_stats> &stats,
+                                         int n) {
+  std::vector<int> order(stats.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  auto score = [&stats](int i) {
+    return stats[i].logprob / std::max(1, stats[i].n_predicted);
+  };
+  std::stable_sort(order.begin(), order.end(),
+                   [&score](int a, int b) { return score(a) > score(b); });
+  order.resize(std::min<size_t>(n, order.size()));
+  return order;
+}
 
-    if (n_ctx_used + batch.n_tokens > n_ctx) {
-      AVLLM_LOG_WARN("%s: the context is exceeded. \n", __func__);
-      func_(-1, "");
-      return -1;
-    }
-    if (llama_decode(ctx, batch)) {
-      AVLLM_LOG_ERROR("%s : failed to eval, return code %d\n", __func__, 1);
-      func_(-1, "");
-      return -1;
+// embed the inputs in as few llama_decode as possible: each input is a
+// sequence, a batch holds up to n_batch tokens and n_seq_max sequences
+static int context_embed_batch(llama_context *ctx,
+                               const std::vector<llama_tokens> &inputs,
+                               std::vector<std::vector<float>> &embeddings) {
+  const int n_batch = llama_n_batch(ctx);
+  const int n_seq_max = llama_n_seq_max(ctx);
+  const int n_embd = llama_model_n_embd(llama_get_model(ctx));
+
+  embeddings.assign(inputs.size(), std::vector<float>(n_embd));
+  llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+  int rc = 0;
+  for (size_t i = 0; i < inputs.size() && rc == 0;) {
+    const size_t first = i;
+    common_batch_clear(batch);
+    for (int seq = 0; i < inputs.size() && seq < n_seq_max &&
+                      batch.n_tokens + (int)inputs[i].size() <= n_batch;
+         seq++, i++) {
+      for (size_t pos = 0; pos < inputs[i].size(); pos++)
+        common_batch_add(batch, inputs[i][pos], pos, {seq}, true);
     }
-
-    new_token = llama_sampler_sample(smpl, ctx, -1);
-    if (llama_vocab_is_eog(vocab, new_token)) {
-      func_(-1, "");
+    if (i == first) {  // an input larger than the batch
+      rc = -1;
       break;
     }
 
-    char buf[100];
-    int n = llama_token_to_piece(vocab, new_token, buf, sizeof(buf), 0, true);
-    if (n < 0) {
-      AVLLM_LOG_ERROR("%s, failed to convert a token \n", __func__);
-      func_(-1, "");
-      return -1;
-    }
-
-    std::string out(buf, n);
-    // std::cout << out;
+#ifndef NDEBUG
+    llama_batch_print(&batch);
+#endif  // NDEBUG
 
-    if (func_(0, out) < 0) {
-      AVLLM_LOG_WARN("%s, terminated by caller \n", __func__);
-      return 0;
+    llama_memory_clear(llama_get_memory(ctx), true);
+    if (llama_decode(ctx, batch) != 0) {
+      rc = -1;
+      break;
     }
 
-    batch = llama_batch_get_one(&new_token, 1);
+    for (size_t k = first; k < i; k++) {
+      float *embd = llama_get_embeddings_seq(ctx, k - first);
+      if (embd == nullptr) {
+        AVLLM_LOG_ERROR("%s: no pooled embedding for seq %zu\n", __func__,
+                        k - first);
+        rc = -1;
+        break;
+      }
+      common_embd_normalize(embd, embeddings[k].data(), n_embd,
+                            cparams_emb.embd_normalize);
+    }
   }
 
-  return 0;  // return -1 means end of the ctx_session_ session
-};
+  llama_batch_free(batch);
+  return rc;
+}
 
 void server_cmd_handler(std::filesystem::path model_path) {
 #ifdef NDEBUG
@@ -679,39 +861,103 @@ void server_cmd_handler(std::filesystem::path model_path) {
         }
       }
 
-      // initialize the sampler
+      // the sampling defaults of the requests, each slot builds its own
+      // sampler chain from the request's options
+      sampling_default.repeat_penalty = xoptions_.repeat_penalty;
+      prompt_tokens_cache.set_min_len(
+          std::max(0, xoptions_.token_cache_min_len));
+
       {
-        auto sparams = llama_sampler_chain_default_params();
-        sparams.no_perf = false;
-        llama_sampler *smpl_ = llama_sampler_chain_init(sparams);
-        llama_sampler_chain_add(smpl_, llama_sampler_init_greedy());
-        sampler_default_ptr = llama_sampler_ptr(smpl_);
+        // one shared context, each slot is a sequence of n_ctx tokens. with
+        // --kv-total the slots share a unified KV of that many cells
+        n_slots = std::max(1, xoptions_.n_parallel);
+        n_slots = std::min(n_slots, is_kv_unified() ? 64 : 16);
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.no_perf = false;
+        ctx_params.n_ctx = n_ctx_total();
+        ctx_params.kv_unified = is_kv_unified();
+        ctx_params.n_batch = xoptions_.n_batch;
+        ctx_params.n_ubatch = xoptions_.n_ubatch;
+        ctx_params.n_seq_max = n_slots;
+        ctx_params.flash_attn = true;
+        ctx_params.type_k = kv_cache_type_from_str(xoptions_.cache_type_k);
+        ctx_params.type_v = kv_cache_type_from_str(xoptions_.cache_type_v);
+        kv_cache_print(model_ptr.get(), ctx_params);
+        ctx_ptr = llama_context_ptr(
+            llama_init_from_model(model_ptr.get(), ctx_params));
       }
 
-      if (!sampler_default_ptr) {
-        AVLLM_LOG_ERROR("%s: error: could not create sampling\n", __func__);
+      if (!ctx_ptr) {
+        AVLLM_LOG_ERROR("%s: error: failed to create the llama_context\n",
+                        __func__);
         return;
       }
 
-      {
-        int num_context = std::max(1, xoptions_.n_parallel);
-        num_context = std::min(num_context, 16);
-        for (int i = 0; i < num_context; i++) {
-          llama_context_params ctx_params = llama_context_default_params();
-          llama_model *model = model_ptr.get();
-          ctx_params.no_perf = false;
-          ctx_params.n_ctx = xoptions_.n_ctx;
-          ctx_params.n_batch = xoptions_.n_batch;
-          ctx_params.n_ubatch = xoptions_.n_ubatch;
-          ctx_params.flash_attn = true;
-          contexts.emplace_back(
-              llama_init_from_model(model_ptr.get(), ctx_params));
-        }
-      }
+      scheduler = std::make_unique<batch_scheduler>(ctx_ptr.get(), n_slots);
+      scheduler->set_n_draft(xoptions_.n_draft);
+      if (is_kv_unified()) scheduler->set_kv_unified(xoptions_.n_ctx);
+      scheduler->set_ctx_overflow(ctx_overflow_from_str(xoptions_.ctx_overflow),
+                                  xoptions_.n_keep, xoptions_.ctx_discard);
+      if (xoptions_.model_path_draft != "") init_draft();
+      if (xoptions_.session_cache)
+        scheduler->set_session_dir(app_data_path / "sessions");
+      scheduler->set_host_cache((size_t)xoptions_.kv_host_cache_mb << 20);
+      scheduler->start();
 
       initialized = true;
     }
 
+    bool is_kv_unified() const { return xoptions_.kv_total > 0; }
+
+    // the cells of the KV of the shared context
+    uint32_t n_ctx_total() const {
+      return is_kv_unified() ? xoptions_.kv_total : xoptions_.n_ctx * n_slots;
+    }
+
+    // the draft model for speculative decoding shares the vocab of the target
+    void init_draft() {
+      llama_model_params model_params = llama_model_default_params();
+      model_params.n_gpu_layers = xoptions_.ngl;
+      draft_model_ptr = llama_model_ptr(llama_model_load_from_file(
+          xoptions_.model_path_draft.c_str(), model_params));
+      if (!draft_model_ptr) {
+        AVLLM_LOG_WARN("%s: unable to load the draft model\n", __func__);
+        return;
+      }
+
+      const llama_vocab *vocab = llama_model_get_vocab(model_ptr.get());
+      const llama_vocab *vocab_dft =
+          llama_model_get_vocab(draft_model_ptr.get());
+      if (llama_vocab_n_tokens(vocab) != llama_vocab_n_tokens(vocab_dft)) {
+        AVLLM_LOG_WARN("%s: the draft model vocab does not match, disabled\n",
+                       __func__);
+        return;
+      }
+
+      llama_context_params ctx_params = llama_context_default_params();
+      ctx_params.no_perf = false;
+      ctx_params.n_ctx = n_ctx_total();
+      ctx_params.kv_unified = is_kv_unified();
+      ctx_params.n_batch = xoptions_.n_batch;
+      ctx_params.n_ubatch = xoptions_.n_ubatch;
+      ctx_params.n_seq_max = n_slots;
+      ctx_params.flash_attn = true;
+      ctx_params.type_k = kv_cache_type_from_str(xoptions_.cache_type_k);
+      ctx_params.type_v = kv_cache_type_from_str(xoptions_.cache_type_v);
+      kv_cache_print(draft_model_ptr.get(), ctx_params);
+      draft_ctx_ptr = llama_context_ptr(
+          llama_init_from_model(draft_model_ptr.get(), ctx_params));
+      if (!draft_ctx_ptr) {
+        AVLLM_LOG_WARN("%s: failed to create the draft context\n", __func__);
+        return;
+      }
+
+      scheduler->set_draft(draft_ctx_ptr.get());
+      AVLLM_LOG_INFO("%s: speculative decoding with %s, n_draft = %d\n",
+                     __func__, xoptions_.model_path_draft.c_str(),
+                     xoptions_.n_draft);
+    }
+
     const llama_model *get_model() const {
       if (!model_ptr) {
         AVLLM_LOG_ERROR("%s: error: model is not initialized\n", __func__);
@@ -720,49 +966,73 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return model_ptr.get();
     }
 
-    llama_sampler *get_sampler() {
-      if (!sampler_default_ptr) {
-        AVLLM_LOG_ERROR("%s: error: sampler is not initialized\n", __func__);
-        return nullptr;
-      }
-      return sampler_default_ptr.get();
+    const sampling_params &get_sampling_default() const {
+      return sampling_default;
+    }
+
+    // compile the grammar of the request ahead, false when it is invalid
+    bool prepare_sampling(const sampling_params &params) {
+      if (params.grammar.empty() && params.json_schema.empty()) return true;
+      return scheduler->get_grammars().prepare(
+          llama_model_get_vocab(model_ptr.get()), params);
     }
 
     llama_context *get_context(int idx) {
-      if (idx < 0 || idx >= (int)contexts.size()) {
+      if (idx < 0 || idx >= n_slots) {
         AVLLM_LOG_ERROR("%s: error: invalid context index %d\n", __func__, idx);
         return nullptr;
       }
-      return contexts[idx].get();
+      return ctx_ptr.get();
     }
 
-    int get_n_ctx() const { return contexts.size(); }
+    batch_scheduler &get_scheduler() { return *scheduler; }
+
+    int get_n_ctx() const { return n_slots; }
 
+    // the tokens of a prompt, large repeated prompts are tokenized once
     std::vector<llama_token> model_string_to_tokens(const std::string &str) {
-      llama_model *model = model_ptr.get();
-      auto tokens = [&model, &str]() -> std::vector<llama_token> {
-        const llama_vocab *vocab = llama_model_get_vocab(model);
-        int n_token =
-            -llama_tokenize(vocab, str.data(), str.size(), NULL, 0, true, true);
-        std::vector<llama_token> tokens(n_token);
-        if (llama_tokenize(vocab, str.data(), str.size(), tokens.data(),
-                           tokens.size(), true, true) < 0)
-          return {};
-        return tokens;
-      }();
-      return tokens;
+      return prompt_tokens_cache.tokenize(
+          llama_model_get_vocab(model_ptr.get()), str, true, true);
     };
 
+    // the prompt of a chat request and its tokens. the messages of the
+    // previous turns are tokenized once, see chat_prompt_cache
+    std::vector<llama_token> chat_to_tokens(const json &body,
+                                            std::string &prompt) {
+      prompt = model_oaicompact_to_text(chat_templates_ptr.get(), body);
+      if (prompt.empty()) return {};
+
+      // a new conversation: the first message is rendered alone, its
+      // tokens are shared by the conversations with the same system prompt
+      auto render_head = [this, &body]() {
+        json head = body;
+        head["messages"] = json::array({body.at("messages").at(0)});
+        return model_oaicompact_to_text(chat_templates_ptr.get(), head, false);
+      };
+
+      std::string salt = json_value(body, "tools", json()).dump() +
+                         (xoptions_.jinja ? "/jinja" : "");
+      return chat_prompts.tokenize(
+          llama_model_get_vocab(model_ptr.get()), prompt,
+          chat_prompt_cache::prefix_hashes(body.at("messages"), salt),
+          render_head);
+    }
+
     bool is_initialized() const { return initialized; }
 
     llama_model_ptr model_ptr = nullptr;
     common_chat_templates_ptr chat_templates_ptr = nullptr;
-    llama_sampler_ptr sampler_default_ptr = nullptr;
+    chat_prompt_cache chat_prompts;
+    token_cache prompt_tokens_cache;
+    sampling_params sampling_default;
     std::string model_path;
     bool initialized = false;
-    // llama_context_ptr ctx_ptr;
 
-    std::vector<llama_context_ptr> contexts;
+    llama_context_ptr ctx_ptr;
+    llama_model_ptr draft_model_ptr;
+    llama_context_ptr draft_ctx_ptr;
+    std::unique_ptr<batch_scheduler> scheduler;
+    int n_slots = 0;
 
   } model_general(model_path.generic_string());
 
@@ -787,6 +1057,9 @@ void server_cmd_handler(std::filesystem::path model_path) {
                                 ? cparams_emb.n_ctx
                                 : cparams_emb.n_batch;
       cparams_emb.n_ubatch = cparams_emb.n_batch;
+      // pack many inputs per decode, sharing the KV of the context
+      cparams_emb.n_parallel = 32;
+      cparams_emb.kv_unified = true;
       cparams_emb.n_gpu_layers = xoptions_.ngl;
       // cparams_emb.
       llama_model_ptr model = []() {
@@ -802,6 +1075,158 @@ void server_cmd_handler(std::filesystem::path model_path) {
     }
   }
 
+  // pool of warmed embedding contexts, checked out per request
+  struct embedding_pool_t {
+    void init(llama_model *model, int n_ctx) {
+      llama_context_params cparams =
+          common_context_params_to_llama(cparams_emb);
+      for (int i = 0; i < n_ctx; i++) {
+        llama_context *ctx = llama_init_from_model(model, cparams);
+        if (!ctx) {
+          AVLLM_LOG_ERROR("%s: error: failed to create embedding context\n",
+                          __func__);
+          break;
+        }
+        contexts.emplace_back(ctx);
+        free_contexts.push_back(ctx);
+      }
+    }
+
+    // wait until a context is free
+    llama_context *acquire() {
+      std::unique_lock lk(mt);
+      cv.wait(lk, [this]() { return !free_contexts.empty(); });
+      llama_context *ctx = free_contexts.back();
+      free_contexts.pop_back();
+      return ctx;
+    }
+
+    void release(llama_context *ctx) {
+      llama_memory_clear(llama_get_memory(ctx), true);
+      std::lock_guard lk(mt);
+      free_contexts.push_back(ctx);
+      cv.notify_one();
+    }
+
+    int size() const { return contexts.size(); }
+
+    std::vector<llama_context_ptr> contexts;
+    std::vector<llama_context *> free_contexts;
+    std::mutex mt;
+    std::condition_variable cv;
+  } embedding_pool;
+
+  if (model_embedding)
+    embedding_pool.init(model_embedding.get(),
+                        std::max(1, xoptions_.n_parallel_emb));
+
+  // micro-batching: the requests arriving within --emb-batch-ms share one
+  // decode. the first waiting request leads the batch, the others wait for
+  // their slice of the result
+  struct embedding_batcher_t {
+    struct job {
+      const std::vector<llama_tokens> *inputs;
+      std::vector<std::vector<float>> *embeddings;
+      int n_tokens = 0;
+      int rc = 0;
+      bool taken = false;
+      bool done = false;
+    };
+
+    embedding_batcher_t(embedding_pool_t &pool_) : pool(pool_) {}
+
+    int embed(const std::vector<llama_tokens> &inputs,
+              std::vector<std::vector<float>> &embeddings) {
+      if (xoptions_.emb_batch_ms <= 0) {
+        llama_context *ctx = pool.acquire();
+        int rc = context_embed_batch(ctx, inputs, embeddings);
+        pool.release(ctx);
+        return rc;
+      }
+
+      job j{&inputs, &embeddings};
+      for (const auto &tokens : inputs) j.n_tokens += tokens.size();
+
+      std::unique_lock lk(mt);
+      pending.push_back(&j);
+      cv.notify_all();
+      while (!j.done) {
+        if (!j.taken && !collecting)
+          lead(lk);
+        else
+          cv.wait(lk);
+      }
+      return j.rc;
+    }
+
+   private:
+    bool is_full() const {
+      int n_tokens = 0;
+      int n_seq = 0;
+      for (const job *j : pending) {
+        n_tokens += j->n_tokens;
+        n_seq += j->inputs->size();
+      }
+      return n_tokens >= (int)cparams_emb.n_batch ||
+             n_seq >= cparams_emb.n_parallel;
+    }
+
+    void lead(std::unique_lock<std::mutex> &lk) {
+      collecting = true;
+      cv.wait_for(lk, std::chrono::milliseconds(xoptions_.emb_batch_ms),
+                  [this]() { return is_full(); });
+
+      // take the waiting jobs, in order, as long as they fit in one batch
+      std::vector<job *> jobs;
+      int n_tokens = 0;
+      int n_seq = 0;
+      while (!pending.empty()) {
+        job *j = pending.front();
+        if (!jobs.empty() &&
+            (n_tokens + j->n_tokens > (int)cparams_emb.n_batch ||
+             n_seq + (int)j->inputs->size() > cparams_emb.n_parallel))
+          break;
+        n_tokens += j->n_tokens;
+        n_seq += j->inputs->size();
+        j->taken = true;
+        jobs.push_back(j);
+        pending.erase(pending.begin());
+      }
+      collecting = false;
+      cv.notify_all();  // the next batch can be collected meanwhile
+      lk.unlock();
+
+      std::vector<llama_tokens> inputs;
+      for (const job *j : jobs)
+        inputs.insert(inputs.end(), j->inputs->begin(), j->inputs->end());
+      std::vector<std::vector<float>> embeddings;
+      llama_context *ctx = pool.acquire();
+      int rc = context_embed_batch(ctx, inputs, embeddings);
+      pool.release(ctx);
+      AVLLM_LOG_DEBUG("%s: %zu requests, %zu inputs in one batch\n", __func__,
+                      jobs.size(), inputs.size());
+
+      lk.lock();
+      size_t k = 0;
+      for (job *j : jobs) {
+        size_t n = j->inputs->size();
+        if (rc == 0)
+          j->embeddings->assign(embeddings.begin() + k,
+                                embeddings.begin() + k + n);
+        k += n;
+        j->rc = rc;
+        j->done = true;
+      }
+      cv.notify_all();
+    }
+
+    embedding_pool_t &pool;
+    std::vector<job *> pending;
+    bool collecting = false;
+    std::mutex mt;
+    std::condition_variable cv;
+  } embedding_batcher(embedding_pool);
+
   // embedded web
   // legacy api
   struct handle_static_file {
@@ -999,6 +1424,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
     std::string model_name = json_value(body_, "model", std::string("model"));
     std::string input = json_value(body_, "input", std::string(""));
     std::string play = json_value(body_, "play", std::string("continue"));
+    // "stops" ends the output with the stop string, "stop" excludes it
     std::string stops = json_value(body_, "stops", std::string(""));
     bool is_stream = json_value(body_, "stream", bool(false));
 
@@ -1011,21 +1437,30 @@ void server_cmd_handler(std::filesystem::path model_path) {
     std::string id = string_generate_random(64);
     int time = std::time(0);
 
-    // llama_sampler * smpl  = model_general.get_sampler();
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false;
-    llama_sampler *smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(10));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(1.0f));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(1.0f, 0.05));
-    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
-    // llama_sampler_chain_add(smpl, llama_sampler_init_dist(time));
-    auto smpl_response = llama_sampler_ptr(smpl);
-
-    if (play == "restart") {
-      AVLLM_LOG_TRACE("play: %s \n", play.c_str());
-      llama_memory_clear(llama_get_memory(ctx), true);
+    // "continue" keeps the KV of the session's slot, "restart" starts from
+    // scratch
+    gen_params params;
+    params.cancelled = session_closed_flag(res);
+    params.session_id = json_value(body_, "session_id",
+                                   json_value(body_, "user", std::string()));
+    params.speculative =
+        spec_mode_from_str(json_value(body_, "speculative", std::string()));
+    params.append = play != "restart";
+    params.n_predict =
+        n_predict_from_json(body_, {"max_output_tokens"}, xoptions_.n_predict);
+    if (!stops.empty()) {
+      params.stop = {stops};
+      params.is_stop_inclusive = true;
+    } else {
+      params.stop = stop_strings_from_json(body_);
     }
+    params.sampling = sampling_params_from_json(
+        body_, llama_model_get_vocab(model),
+        model_general.get_sampling_default());
+    if (!model_general.prepare_sampling(params.sampling))
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid grammar or json schema");
+    AVLLM_LOG_TRACE("play: %s \n", play.c_str());
 
     // tokenize the prompt
     auto prompt_tokens = model_general.model_string_to_tokens(input);
@@ -1034,7 +1469,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
                                "Tokenization failed - no tokens generated");
 
-    static auto response_created = [&]() -> json {
+    auto response_created = [&]() -> json {
       json data = {{"type", "response.created"},
                    {"response",
                     {{"id", "resp_" + id},
@@ -1064,7 +1499,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return data;
     };
 
-    static auto response_in_progress = [&]() -> json {
+    auto response_in_progress = [&]() -> json {
       json j = {{"type", "response.in_progress"},
                 {"response",
                  {{"id", "resp_" + id},
@@ -1094,7 +1529,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return j;
     };
 
-    static auto response_output_item_added = [&]() -> json {
+    auto response_output_item_added = [&]() -> json {
       json data = {{"type", "response.output_item.added"},
                    {"output_index", 0},
                    {"item",
@@ -1106,7 +1541,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return data;
     };
 
-    static auto response_content_part_added = [&]() -> json {
+    auto response_content_part_added = [&]() -> json {
       json data = {{"type", "response.content_part.added"},
                    {"item_id", "msg_" + id},
                    {"output_index", 0},
@@ -1119,17 +1554,15 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return data;
     };
 
-    static auto response_output_text_delta = [&](std::string delta) -> json {
-      json data = {{"type", "response.output_text.delta"},
-                   {"item_id", "msg_" + id},
-                   {"output_index", 0},
-                   {"content_index", 0},
-                   {"delta", delta}};
+    // the deltas are the bulk of the stream, only the delta text is
+    // serialized per token
+    sse_delta_serializer serialize_delta(
+        "data: {\"type\":\"response.output_text.delta\",\"item_id\":" +
+            json("msg_" + id).dump() +
+            ",\"output_index\":0,\"content_index\":0,\"delta\":\"",
+        "\"}\n\n");
 
-      return data;
-    };
-
-    static auto response_output_text_done = [&](std::string text) -> json {
+    auto response_output_text_done = [&](std::string text) -> json {
       json data = {{"type", "response.output_text.done"},
                    {"item_id", "msg_" + id},
                    {"output_index", 0},
@@ -1139,7 +1572,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return data;
     };
 
-    static auto response_content_part_done = [&](std::string text) -> json {
+    auto response_content_part_done = [&](std::string text) -> json {
       json data = {{"type", "response.output_text.done"},
                    {"item_id", "msg_" + id},
                    {"output_index", 0},
@@ -1149,7 +1582,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return data;
     };
 
-    static auto response_output_item_done = [&](std::string text) {
+    auto response_output_item_done = [&](std::string text) {
       json data = {
           {"type", "response.output_item.done"},
           {"output_index", 0},
@@ -1164,7 +1597,9 @@ void server_cmd_handler(std::filesystem::path model_path) {
       return data;
     };
 
-    static auto response_completed = [&](std::string text) -> json {
+    auto response_completed = [&](std::string text, uint32_t input_tokens,
+                                  const gen_stats &stats) -> json {
+      uint32_t output_tokens = stats.n_predicted;
       json data = {
           {"type", "response.completed"},
           {"response",
@@ -1197,10 +1632,16 @@ void server_cmd_handler(std::filesystem::path model_path) {
             {"top_p", 1.0},
             {"truncation", "disabled"},
             {"usage",
-             {{"input_tokens", 37},
-              {"output_tokens", 11},
-              {"output_tokens_details", {{"reasoning_tokens", 0}}},
-              {"total_tokens", 48}}},
+             {{"input_tokens", input_tokens},
+              {"input_tokens_details",
+               {{"cached_tokens", stats.n_prompt_cached}}},
+              {"output_tokens", output_tokens},
+              {"output_tokens_details",
+               {{"reasoning_tokens", 0},
+                {"accepted_prediction_tokens", stats.n_draft_accepted},
+                {"rejected_prediction_tokens",
+                 stats.n_draft - stats.n_draft_accepted}}},
+              {"total_tokens", input_tokens + output_tokens}}},
             {"user", nullptr},
             {"metadata", json::object()}}}};
 
@@ -1209,116 +1650,76 @@ void server_cmd_handler(std::filesystem::path model_path) {
 
     if (is_stream) {
       std::string gen_text;
-      uint32_t completion_tokens = 0;
-      uint32_t prompt_tokens_size = static_cast<uint32_t>(prompt_tokens.size());
-      bool is_end_of_gen_found = false;
-
-      auto gen_text_hdl = [prompt_tokens_size, &gen_text, &completion_tokens,
-                           &res, &stops, &is_end_of_gen_found](
-                              int rc, const std::string &text) -> int {
-        if (completion_tokens >= xoptions_.n_predict) {
-          AVLLM_LOG_WARN("token is exceeded : %d:%d \n", completion_tokens,
-                         xoptions_.n_predict);
-          res->chunk_write_async("event: response.output_text.done\n");
-          res->chunk_write_async(
-              "data: " + response_output_text_done(gen_text).dump() + "\n\n");
-          return -1;  // end of generation
-        }
-        if (rc == 0 and not is_end_of_gen_found) {
+
+      // the stop strings and the token limit are enforced by the scheduler
+      sse_writer<http::response> out(res, xoptions_.stream_flush_ms,
+                                     xoptions_.stream_flush_bytes);
+      auto gen_text_hdl = [&gen_text, &out, &response_output_text_done,
+                           &serialize_delta](int rc,
+                                             const std::string &text) -> int {
+        if (rc == 0) {
           std::cout << text;
-          res->chunk_write_async("event: response.output_text.delta\n");
-          res->chunk_write_async(
-              "data: " + response_output_text_delta(text).dump() + "\n\n");
+          if (!text.empty())
+            out.write("response.output_text.delta", serialize_delta(text));
           gen_text += text;
-
-          if (not stops.empty() and text.find(stops) != std::string::npos) {
-            // std::cou << "found } \n";
-            // res->chunk_write_async("event: response.output_text.done\n");
-            // res->chunk_write_async("data: " +
-            // response_output_text_done(gen_text).dump() + "\n\n"); return -1;
-            is_end_of_gen_found = true;
-          }
-        } else if (rc == 0 and is_end_of_gen_found) {
-          AVLLM_LOG_WARN("expected the eog: %s \n", text.c_str());
-          completion_tokens++;
-          res->chunk_write_async("event: response.output_text.done\n");
-          res->chunk_write_async(
-              "data: " + response_output_text_done(gen_text).dump() + "\n\n");
-          return -1;
         } else {
-          res->chunk_write_async("event: response.output_text.done\n");
-          res->chunk_write_async(
-              "data: " + response_output_text_done(gen_text).dump() + "\n\n");
+          out.write("response.output_text.done",
+                    "data: " + response_output_text_done(gen_text).dump() +
+                        "\n\n");
         }
-
-        completion_tokens++;
         return 0;  // continue generation
       };
 
       res->chunk_start_async();
-      res->chunk_write_async("event: response.created\n");
-      res->chunk_write_async("data: " + response_created().dump() + "\n\n");
-      res->chunk_write_async("event: response.in_progress\n");
-      res->chunk_write_async("data: " + response_in_progress().dump() + "\n\n");
-      res->chunk_write_async("event: response.output_item.added\n");
-      res->chunk_write_async("data: " + response_output_item_added().dump() +
-                             "\n\n");
-      res->chunk_write_async("event: response.content_part.added\n");
-      res->chunk_write_async("data: " + response_content_part_added().dump() +
-                             "\n\n");
-      context_gen_text_until_eog(ctx, prompt_tokens, std::ref(gen_text_hdl),
-                                 smpl);
-      res->chunk_write_async("event: response.content_part.done\n");
-      res->chunk_write_async(
-          "data: " + response_content_part_done(gen_text).dump() + "\n\n");
-      res->chunk_write_async("event: response.output_item.done\n");
-      res->chunk_write_async("data: " + response_output_item_done("").dump() +
-                             "\n\n");
-      res->chunk_write_async("event: response.completed\n");
-      res->chunk_write_async("data: " + response_completed("").dump() + "");
+      out.write("response.created",
+                "data: " + response_created().dump() + "\n\n");
+      out.write("response.in_progress",
+                "data: " + response_in_progress().dump() + "\n\n");
+      out.write("response.output_item.added",
+                "data: " + response_output_item_added().dump() + "\n\n");
+      out.write("response.content_part.added",
+                "data: " + response_content_part_added().dump() + "\n\n");
+      out.flush();  // the client sees the response start before the prefill
+      gen_stats stats;
+      context_gen_text_until_eog(model_general.get_scheduler(), prompt_tokens,
+                                 std::ref(gen_text_hdl), params, &stats);
+      out.write("response.content_part.done",
+                "data: " + response_content_part_done(gen_text).dump() +
+                    "\n\n");
+      out.write("response.output_item.done",
+                "data: " + response_output_item_done("").dump() + "\n\n");
+      out.write("response.completed",
+                "data: " +
+                    response_completed(
+                        "", static_cast<uint32_t>(prompt_tokens.size()),
+                        stats)
+                        .dump() +
+                    "");
+      out.flush();
       res->chunk_end_async();
     } else {
       // write above struct in lambda function
       std::string gen_text;
-      uint32_t completion_tokens = 0;
       uint32_t prompt_tokens_size = static_cast<uint32_t>(prompt_tokens.size());
-      bool is_end_of_gen_found = false;
-
-      auto gen_text_hdl = [prompt_tokens_size, &gen_text, &completion_tokens,
-                           &stops, &is_end_of_gen_found](
-                              int rc, const std::string &text) -> int {
-        if (completion_tokens >= xoptions_.n_predict) {
-          AVLLM_LOG_WARN("token is exceeded : %d:%d \n", completion_tokens,
-                         xoptions_.n_predict);
-          return -1;  // end of generation
-        }
-        if (rc == 0 and not is_end_of_gen_found) {
-          gen_text += text;
-          if (not stops.empty() and text.find(stops) != std::string::npos) {
-            // std::cou << "\nfound } \n";
-            // std::cou << gen_text << std::endl;
-            is_end_of_gen_found = true;
-          }
-        } else if (rc == 0 and is_end_of_gen_found) {
-          AVLLM_LOG_WARN("expected the eog: %s \n", text.c_str());
-          completion_tokens++;
-          return -1;
-        }
 
-        completion_tokens++;
-        // std::cout << std::flush;
+      auto gen_text_hdl = [&gen_text](int rc, const std::string &text) -> int {
+        if (rc == 0) gen_text += text;
         return 0;  // continue generation
       };
 
-      context_gen_text_until_eog(ctx, prompt_tokens, std::ref(gen_text_hdl),
-                                 smpl);
+      gen_stats stats;
+      context_gen_text_until_eog(model_general.get_scheduler(), prompt_tokens,
+                                 std::ref(gen_text_hdl), params, &stats);
+      uint32_t completion_tokens = stats.n_predicted;
+      bool is_length = stats.finish_reason == "length";
       json res_body = {
           {"id", "resp_" + id},
           {"object", "response"},
           {"created_at", time},
-          {"status", "completed"},
+          {"status", is_length ? "incomplete" : "completed"},
           {"error", nullptr},
-          {"incomplete_details", nullptr},
+          {"incomplete_details",
+           is_length ? json{{"reason", "max_output_tokens"}} : json(nullptr)},
           {"instructions", nullptr},
           {"max_output_tokens", nullptr},
           {"model", model_name},
@@ -1343,9 +1744,14 @@ void server_cmd_handler(std::filesystem::path model_path) {
           {"truncation", "disabled"},
           {"usage",
            {{"input_tokens", prompt_tokens_size},
-            {"input_tokens_details", {{"cached_tokens", 0}}},
+            {"input_tokens_details",
+             {{"cached_tokens", stats.n_prompt_cached}}},
             {"output_tokens", completion_tokens},
-            {"output_tokens_details", {{"reasoning_tokens", 0}}},
+            {"output_tokens_details",
+             {{"reasoning_tokens", 0},
+              {"accepted_prediction_tokens", stats.n_draft_accepted},
+              {"rejected_prediction_tokens",
+               stats.n_draft - stats.n_draft_accepted}}},
             {"total_tokens", prompt_tokens_size + completion_tokens}}},
           {"user", nullptr},
           {"metadata", nlohmann::json::object()}};
@@ -1368,7 +1774,6 @@ void server_cmd_handler(std::filesystem::path model_path) {
     llama_context *ctx = model_general.get_context(ctx_idx);
     const llama_model *model = llama_get_model(ctx);
     const llama_vocab *vocab = llama_model_get_vocab(model);
-    llama_sampler *smpl = model_general.get_sampler();
 
     json body_ = json_parse(res->reqwest().body());
     if (body_.empty())
@@ -1376,10 +1781,39 @@ void server_cmd_handler(std::filesystem::path model_path) {
                                "invalid json");
 
     std::string model_name = json_value(body_, "model", std::string("model"));
-    int max_tokens = json_value(body_, "max_tokens", int(1024));
+    int max_tokens =
+        n_predict_from_json(body_, {"max_tokens"}, xoptions_.n_predict);
     std::string prompt = json_value(body_, "prompt", std::string());
     bool is_stream = json_value(body_, "stream", bool(false));
-    int64_t temperature = json_value(body_, "temperature", int64_t(0));
+
+    // parallel sampling: best_of completions share the prefill, the n with
+    // the highest log probability are returned
+    int n = json_value(body_, "n", 1);
+    int best_of = json_value(body_, "best_of", n);
+    if (n < 1 || best_of < n)
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid n or best_of");
+    if (best_of > model_general.get_scheduler().get_n_seq())
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "n or best_of exceeds the number of slots");
+    if (is_stream && best_of > n)
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "best_of can't be streamed");
+
+    gen_params params;
+    params.cancelled = session_closed_flag(res);
+    params.session_id = json_value(body_, "session_id",
+                                   json_value(body_, "user", std::string()));
+    params.speculative =
+        spec_mode_from_str(json_value(body_, "speculative", std::string()));
+    params.n_predict = max_tokens;
+    params.stop = stop_strings_from_json(body_);
+    params.is_logprob = best_of > n;
+    params.sampling = sampling_params_from_json(
+        body_, vocab, model_general.get_sampling_default());
+    if (!model_general.prepare_sampling(params.sampling))
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid grammar or json schema");
 
     AVLLM_LOG_DEBUG("[%05" PRIu64 "] [%05" PRIu64
                     "] max_tokens=%d, prompt=%s, is_stream=%d\n",
@@ -1394,37 +1828,44 @@ void server_cmd_handler(std::filesystem::path model_path) {
         HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
                                  "Tokenization failed - no tokens generated");
 
-      if (prompt_tokens.size() >= max_tokens)
-        HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
-                                 "Prompt tokens size exceeds max_tokens limit");
-
       if (not is_stream) {
         // write above struct in lambda function
-        std::string gen_text;
-        uint32_t completion_tokens = 0;
+        std::vector<std::string> gen_text(best_of);
         uint32_t prompt_tokens_size =
             static_cast<uint32_t>(prompt_tokens.size());
 
-        auto gen_text_hdl = [max_tokens, prompt_tokens_size, &gen_text,
-                             &completion_tokens](
-                                int rc, const std::string &text) -> int {
-          if (completion_tokens + prompt_tokens_size >= max_tokens or
-              completion_tokens >= xoptions_.n_predict)
-            return -1;  // end of generation
-          if (rc == 0) gen_text += text;
-
-          completion_tokens++;
+        auto gen_text_hdl = [&gen_text](int i, int rc,
+                                        const std::string &text) -> int {
+          if (rc == 0) gen_text[i] += text;
           return 0;  // continue generation
         };
 
-        context_gen_text_until_eog(ctx, prompt_tokens, std::ref(gen_text_hdl),
-                                   smpl);
+        std::vector<gen_stats> stats(best_of);
+        context_gen_text_n(model_general.get_scheduler(), prompt_tokens,
+                           best_of, std::ref(gen_text_hdl), params,
+                           stats.data());
 
+        // every sampled completion is counted, the discarded ones included
+        uint32_t completion_tokens = 0;
+        int n_draft = 0;
+        int n_draft_accepted = 0;
+        for (const auto &st : stats) {
+          completion_tokens += st.n_predicted;
+          n_draft += st.n_draft;
+          n_draft_accepted += st.n_draft_accepted;
+        }
+
+        json choices = json::array();
+        for (int i : best_completions(stats, n)) {
 #ifndef NDEBUG
-        AVLLM_LOG_DEBUG("[%05" PRIu64 "] [%05" PRIu64 "] gen_text=%s\n",
-                        res->session_id(), res->reqwest().request_id(),
-                        gen_text.c_str());
+          AVLLM_LOG_DEBUG("[%05" PRIu64 "] [%05" PRIu64 "] gen_text=%s\n",
+                          res->session_id(), res->reqwest().request_id(),
+                          gen_text[i].c_str());
 #endif
+          choices.push_back({{"text", gen_text[i]},
+                             {"index", choices.size()},
+                             {"finish_reason", stats[i].finish_reason}});
+        }
 
         json res_body = {
             {"id", "cmpl-" + string_generate_random(20)},
@@ -1432,41 +1873,43 @@ void server_cmd_handler(std::filesystem::path model_path) {
             {"created", std::time(0)},
             {"model", model_name},
             {"system_fingerprint", "fp_44709d6fcb"},
-            {"choices",
-             {{{"text", gen_text}, {"index", 0}, {"finish_reason", "length"}}}},
+            {"choices", choices},
             {"usage",
              {{"prompt_tokens", prompt_tokens_size},
               {"completion_tokens", completion_tokens},
-              {"total_tokens", prompt_tokens_size + completion_tokens}}}};
+              {"total_tokens", prompt_tokens_size + completion_tokens},
+              {"completion_tokens_details",
+               {{"accepted_prediction_tokens", n_draft_accepted},
+                {"rejected_prediction_tokens",
+                 n_draft - n_draft_accepted}}}}}};
 
         res->set_content(res_body.dump(4));
         // res->end();
         res->endend();
       } else {
-        uint32_t completion_tokens = 0;
-        uint32_t prompt_tokens_size =
-            static_cast<uint32_t>(prompt_tokens.size());
-
-        auto gen_text_hdl = [model_name, max_tokens, prompt_tokens_size, res,
-                             &completion_tokens](int rc,
-                                                 const std::string &text) {
-          if (completion_tokens + prompt_tokens_size >= max_tokens or
-              completion_tokens >= xoptions_.n_predict) {
-            res->chunk_write_async(
-                "data: " + oai_completion_chunk(model_name, "", "length"));
-            return -1;  // end of generation
-          }
-          if (rc == 0)
-            res->chunk_write_async("data: " +
-                                   oai_completion_chunk(model_name, text));
-          completion_tokens++;
+        std::string chunk_id = oai_make_chunk_id(false);
+        std::vector<sse_delta_serializer> serialize;
+        for (int i = 0; i < n; i++)
+          serialize.push_back(
+              oai_chunk_serializer(model_name, chunk_id, false, i));
+        sse_writer<http::response> out(res, xoptions_.stream_flush_ms,
+                                       xoptions_.stream_flush_bytes);
+        auto gen_text_hdl = [&out, &serialize](int i, int rc,
+                                               const std::string &text) {
+          if (rc == 0 && !text.empty()) out.write(serialize[i](text));
           return 0;  // continue generation
         };
 
         // start writing chunk
         res->event_source_start();
-        context_gen_text_until_eog(ctx, prompt_tokens, std::ref(gen_text_hdl),
-                                   smpl);
+        std::vector<gen_stats> stats(n);
+        context_gen_text_n(model_general.get_scheduler(), prompt_tokens, n,
+                           std::ref(gen_text_hdl), params, stats.data());
+        for (int i = 0; i < n; i++)
+          out.write("data: " + oai_completion_chunk(model_name, "",
+                                                    stats[i].finish_reason,
+                                                    chunk_id, i));
+        out.flush();
         res->event_source_oai_end();
       }
     }
@@ -1484,7 +1927,6 @@ void server_cmd_handler(std::filesystem::path model_path) {
     llama_context *ctx = model_general.get_context(ctx_idx);
     const llama_model *model = llama_get_model(ctx);
     const llama_vocab *vocab = llama_model_get_vocab(model);
-    llama_sampler *smpl = model_general.get_sampler();
 
     json body_ = json_parse(res->reqwest().body());
     if (body_.empty())
@@ -1522,26 +1964,47 @@ void server_cmd_handler(std::filesystem::path model_path) {
     bool is_stream = json_value(body_, "stream", bool(false));
     json tools = json_value(body_, "tools", json::array());
 
+    // parallel sampling: n choices share the prefill
+    int n = json_value(body_, "n", 1);
+    if (n < 1)
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid n");
+    if (n > model_general.get_scheduler().get_n_seq())
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "n exceeds the number of slots");
+
+    gen_params params;
+    params.cancelled = session_closed_flag(res);
+    params.session_id = json_value(body_, "session_id",
+                                   json_value(body_, "user", std::string()));
+    params.speculative =
+        spec_mode_from_str(json_value(body_, "speculative", std::string()));
+    params.n_predict = n_predict_from_json(
+        body_, {"max_completion_tokens", "max_tokens"}, xoptions_.n_predict);
+    params.stop = stop_strings_from_json(body_);
+    params.sampling = sampling_params_from_json(
+        body_, vocab, model_general.get_sampling_default());
+    if (!model_general.prepare_sampling(params.sampling))
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid grammar or json schema");
+
     if (is_stream) {  // stream
 
-      auto get_text_hdl = [res, &model_name, state = 0, cnt = 0](
-                              int rc, const std::string &text) mutable -> int {
-        std::string chunk_data;
-        if (rc == 0 && state == 0 && cnt++ < xoptions_.n_predict) {
-          chunk_data = "data: " + oai_chat_completion_chunk(model_name, text);
-          res->chunk_write_async(chunk_data);
-        } else if ((rc < 0 || cnt >= xoptions_.n_predict) && state == 0) {
-          state = 1;  // end of generation
-          chunk_data =
-              "data: " + oai_chat_completion_chunk(model_name, ".", "stop");
-          res->chunk_write_async(chunk_data);
-          return -1;
-        } else
-          return -1;
+      std::string chunk_id = oai_make_chunk_id();
+      std::vector<sse_delta_serializer> serialize;
+      for (int i = 0; i < n; i++)
+        serialize.push_back(
+            oai_chunk_serializer(model_name, chunk_id, true, i));
+      sse_writer<http::response> out(res, xoptions_.stream_flush_ms,
+                                     xoptions_.stream_flush_bytes);
+      auto get_text_hdl = [&out, &serialize](int i, int rc,
+                                             const std::string &text) -> int {
+        if (rc == 0 && !text.empty()) out.write(serialize[i](text));
         return 0;
       };
 
-      std::string messages = model_oaicompact_to_text(model, body_);
+      std::string messages;
+      auto prompt_tokens = model_general.chat_to_tokens(body_, messages);
       if (messages.empty())
         HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                  "Failed to convert messages to text");
@@ -1550,20 +2013,19 @@ void server_cmd_handler(std::filesystem::path model_path) {
                      res->session_id(), res->reqwest().request_id(),
                      messages.c_str());
 
-      int n_tokens = -llama_tokenize(vocab, messages.data(), messages.size(),
-                                     NULL, 0, true, true);
-
-      std::vector<llama_token> prompt_tokens(n_tokens);
-      llama_tokenize(vocab, messages.data(), messages.size(),
-                     prompt_tokens.data(), prompt_tokens.size(), true, true);
-
       if (prompt_tokens.size() == 0)
         HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                  "Tokenization failed - no tokens generated");
 
       res->event_source_start();
-      context_gen_text_until_eog(ctx, prompt_tokens, std::ref(get_text_hdl),
-                                 smpl);
+      std::vector<gen_stats> stats(n);
+      context_gen_text_n(model_general.get_scheduler(), prompt_tokens, n,
+                         std::ref(get_text_hdl), params, stats.data());
+      for (int i = 0; i < n; i++)
+        out.write("data: " + oai_chat_completion_chunk(model_name, "",
+                                                       stats[i].finish_reason,
+                                                       chunk_id, i));
+      out.flush();
       res->event_source_oai_end();
     } else {
       if (tools.empty())
@@ -1576,50 +2038,58 @@ void server_cmd_handler(std::filesystem::path model_path) {
                         tools.dump().c_str());
 
       // default
-      std::string content;
-      uint32_t completion_tokens = 0;
+      std::vector<std::string> content(n);
 
-      auto get_text_hdl = [&content, &completion_tokens](
-                              int rc, const std::string &text) -> int {
-        if (rc == 0) content += text;
-        completion_tokens++;
+      auto get_text_hdl = [&content](int i, int rc,
+                                     const std::string &text) -> int {
+        if (rc == 0) content[i] += text;
         return 0;
       };
 
-      std::string messages = model_oaicompact_to_text(model, body_);
-      int n_tokens = -llama_tokenize(vocab, messages.data(), messages.size(),
-                                     NULL, 0, true, true);
-
-      std::vector<llama_token> prompt_tokens(n_tokens);
-      llama_tokenize(vocab, messages.data(), messages.size(),
-                     prompt_tokens.data(), prompt_tokens.size(), true, true);
+      std::string messages;
+      auto prompt_tokens = model_general.chat_to_tokens(body_, messages);
 
       if (prompt_tokens.size() == 0)
         HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                  "Tokenization failed - no tokens generated");
 
       uint32_t prompt_tokens_size = static_cast<uint32_t>(prompt_tokens.size());
-      context_gen_text_until_eog(ctx, prompt_tokens, std::ref(get_text_hdl),
-                                 smpl);
+      std::vector<gen_stats> stats(n);
+      context_gen_text_n(model_general.get_scheduler(), prompt_tokens, n,
+                         std::ref(get_text_hdl), params, stats.data());
+
+      uint32_t completion_tokens = 0;
+      int n_draft = 0;
+      int n_draft_accepted = 0;
+      json choices = json::array();
+      for (int i = 0; i < n; i++) {
+        completion_tokens += stats[i].n_predicted;
+        n_draft += stats[i].n_draft;
+        n_draft_accepted += stats[i].n_draft_accepted;
+        choices.push_back({{"text", content[i]},
+                           {"index", i},
+                           {"finish_reason", stats[i].finish_reason}});
+      }
+
       json res_body = {
           {"id", "cmpl-" + string_generate_random(20)},
           {"object", "text_completion"},
           {"created", std::time(0)},
           {"model", model_name},
           {"system_fingerprint", "fp_44709d6fcb"},
-          {"choices",
-           {{{"text", content}, {"index", 0}, {"finish_reason", "length"}}}},
+          {"choices", choices},
           {"usage",
            {{"prompt_tokens", prompt_tokens_size},
             {"completion_tokens", completion_tokens},
             {"total_tokens", prompt_tokens_size + completion_tokens},
             {"prompt_tokens_details",
-             {{"cached_tokens", 0}, {"audio_tokens", 0}}},
+             {{"cached_tokens", stats[0].n_prompt_cached},
+              {"audio_tokens", 0}}},
             {"completion_tokens_details",
              {{"reasoning_tokens", 0},
               {"audio_tokens", 0},
-              {"accepted_prediction_tokens", 0},
-              {"rejected_prediction_tokens", 0}}}}},
+              {"accepted_prediction_tokens", n_draft_accepted},
+              {"rejected_prediction_tokens", n_draft - n_draft_accepted}}}}},
           {"service_tier", "default"}};
 
       res->set_content(res_body.dump(4));
@@ -1627,8 +2097,9 @@ void server_cmd_handler(std::filesystem::path model_path) {
     }
   };
 
-  auto embedding_handler =
-      [&model_embedding](std::shared_ptr<http::response> res) -> void {
+  auto embedding_handler = [&model_embedding, &embedding_batcher](
+                               std::shared_ptr<http::response> res,
+                               int worker_id) -> void {
     AVLLM_LOG_TRACE_SCOPE(
         av_llm::string_format("[%05" PRIu64 "] [%05" PRIu64 "] %s",
                               res->session_id(), res->reqwest().request_id(),
@@ -1640,6 +2111,7 @@ void server_cmd_handler(std::filesystem::path model_path) {
       HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                "Embedding model not available");
     llama_model *model = model_embedding.get();
+    const llama_vocab *const vocab = llama_model_get_vocab(model);
 
     json body_js = json_parse(res->reqwest().body());
 
@@ -1647,85 +2119,72 @@ void server_cmd_handler(std::filesystem::path model_path) {
       HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                "Invalid request content");
 
-    // fix: the sentence-level embedding
-    // context
-    llama_context_ptr ctx = [&]() {
-      llama_context_params cparams =
-          common_context_params_to_llama(cparams_emb);
-      return llama_context_ptr(llama_init_from_model(model, cparams));
-    }();
-    GGML_ASSERT(ctx && "Can not initilize the context");
-    if (!ctx) {
-      HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
-                               "Failed to initialize embedding context");
-    }
-
-    std::string input = json_value(body_js, "input", std::string());
-    if (input == "")
+    // "input": string, [string], [token] or [[token]]
+    json input_js = json_value(body_js, "input", json());
+    if (input_js.is_null() || input_js == "" || input_js == json::array())
       HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                "Empty input text");
-
-    // tokenize the prompt
-    auto tokens = [&model, &data = input]() -> std::vector<llama_token> {
-      const llama_vocab *const vocab = llama_model_get_vocab(model);
-      GGML_ASSERT(vocab != nullptr);
-      int n_token =
-          -llama_tokenize(vocab, data.data(), data.size(), NULL, 0, true, true);
-      std::vector<llama_token> tokens(n_token);
-      if (llama_tokenize(vocab, data.data(), data.size(), tokens.data(),
-                         tokens.size(), true, true) < 0)
-        return {};
-      return tokens;
-    }();
-    if (tokens.size() == 0)
-      HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
-                               "Failed to tokenize input");
-
-#ifndef NDEBUG
-    {
-      const llama_vocab *const vocab = llama_model_get_vocab(model);
-      llama_token_print(vocab, tokens);
+    std::string model_name =
+        json_value(body_js, "model", std::string("model"));
+
+    // tokenize the inputs
+    std::vector<llama_tokens> inputs;
+    try {
+      inputs = tokenize_input_prompts(vocab, input_js, true, true);
+    } catch (const std::exception &ex) {
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               ex.what());
     }
-#endif  // NDEBUG
-
-    const uint64_t n_batch = cparams_emb.n_batch;
-    llama_batch batch = llama_batch_init(n_batch, 0, 1);
-
-    for (int pos = 0; pos < tokens.size(); pos++)
-      common_batch_add(batch, tokens[pos], pos, {0}, true);
+    for (const auto &tokens : inputs)
+      if (tokens.empty() || tokens.size() > cparams_emb.n_batch)
+        HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                                 "Input is empty or exceeds the batch size");
 
 #ifndef NDEBUG
-    llama_batch_print(&batch);
+    for (auto &tokens : inputs) llama_token_print(vocab, tokens);
 #endif  // NDEBUG
 
-    if (llama_decode(ctx.get(), batch) < 0) {
+    std::vector<std::vector<float>> embeddings;
+    if (embedding_batcher.embed(inputs, embeddings) < 0)
       HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
                                "Failed to decode embedding batch");
-    }
-
-    int n_embd = llama_model_n_embd(model);
-    std::vector<float> embeddings(n_embd);
 
-    float *embd = llama_get_embeddings_seq(ctx.get(), 0);
-    float *const out = embeddings.data();
-    enum llama_pooling_type pooling_type = llama_pooling_type(ctx.get());
-    common_embd_normalize(embd, out, n_embd, cparams_emb.embd_normalize);
 #ifndef NDEBUG
     {
-      for (int i = 0; i < std::min(3, n_embd); i++)
-        printf("%.6f ", *(embeddings.data() + i));
+      const std::vector<float> &embd = embeddings[0];
+      int n_embd = embd.size();
+      for (int i = 0; i < std::min(3, n_embd); i++) printf("%.6f ", embd[i]);
       printf("...");
 
       for (int i = 0; i < n_embd && i < 2; i++)
-        printf("%.6f ", *(embeddings.data() + n_embd - 1 - i));
+        printf("%.6f ", embd[n_embd - 1 - i]);
     }
 #endif  // NDEBUG
 
-    json j = embeddings;
-    res->set_content(j.dump(4));
-    res->end();
+    // legacy: a single string returns the bare vector
+    if (input_js.is_string()) {
+      json j = embeddings[0];
+      res->set_content(j.dump(4));
+      res->end();
+      return;
+    }
 
-    llama_batch_free(batch);
+    int n_prompt_tokens = 0;
+    json data = json::array();
+    for (size_t i = 0; i < embeddings.size(); i++) {
+      n_prompt_tokens += inputs[i].size();
+      data.push_back({{"object", "embedding"},
+                      {"index", i},
+                      {"embedding", embeddings[i]}});
+    }
+    json j = {{"object", "list"},
+              {"data", data},
+              {"model", model_name},
+              {"usage",
+               {{"prompt_tokens", n_prompt_tokens},
+                {"total_tokens", n_prompt_tokens}}}};
+    res->set_content(j.dump(), MIMETYPE_JSON);
+    res->end();
   };
 
   // infill, fim
@@ -1745,7 +2204,6 @@ void server_cmd_handler(std::filesystem::path model_path) {
     llama_context *ctx = model_general.get_context(ctx_idx);
     const llama_model *model = llama_get_model(ctx);
     const llama_vocab *vocab = llama_model_get_vocab(model);
-    llama_sampler *smpl = model_general.get_sampler();
 
     if (!silent) AVLLM_LOG_INFO("%s \n", res->reqwest().body().c_str());
 
@@ -1843,14 +2301,10 @@ void server_cmd_handler(std::filesystem::path model_path) {
                      input_suffix.c_str());
 
     int n_predict = json_value(body_js, "n_predict", 128);
-    int top_k = json_value(body_js, "top_k", 40);
-    int top_p = json_value(body_js, "top_p", 0.89);
-    int temperature = json_value(body_js, "temperature", 1.0f);
-    int32_t seed = json_value(body_js, "seed", 4294967295);
     json samplers = json_value(body_js, "samplers", json::array());
 
     uint32_t n_batch = llama_n_batch(ctx);
-    uint32_t n_ctx = llama_n_ctx(ctx);
+    uint32_t n_ctx = model_general.get_scheduler().get_n_ctx_seq();
 
     auto tokens = format_infill(vocab, input_prefix, input_suffix,
                                 body_js.at("input_extra"), n_batch, n_predict,
@@ -1865,39 +2319,40 @@ void server_cmd_handler(std::filesystem::path model_path) {
     }
 
     std::string res_body;
-    int decoded = 0;
     auto get_text_hdl = [&](int rc, const std::string &text) -> int {
-      if (decoded++ > n_predict) return -1;
       if (rc == 0) res_body = res_body + text;
 
       return 0;
     };
 
-    // sampler
-    // initialize the sampler
-    llama_sampler_ptr smpl_ = [&vocab, &top_k, &top_p, &seed]() {
-      auto sparams = llama_sampler_chain_default_params();
-      sparams.no_perf = false;
-      auto smpl = llama_sampler_chain_init(sparams);
-      llama_sampler_chain_add(smpl, llama_sampler_init_top_k(top_k));
-      llama_sampler_chain_add(smpl, llama_sampler_init_top_p(top_p, 20));
-      llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
-      return llama_sampler_ptr(smpl);
-    }();
-    if (!smpl_) {
-      AVLLM_LOG_ERROR("%s: error: could not create sampling\n", __func__);
-      HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
-                               "Could not create sampler");
-    }
-    if (!silent) {
-      AVLLM_LOG_DEBUG("%s", "sampler:\n");
-      llama_sampler_print(smpl_.get());
-    }
-
     {
-      context_gen_text_until_eog(ctx, tokens, get_text_hdl, smpl_.get());
+      // fim samples by default: top_k 40, top_p 0.89
+      sampling_params sampling = model_general.get_sampling_default();
+      sampling.temperature = 1.0f;
+      sampling.top_k = 40;
+      sampling.top_p = 0.89f;
+
+      gen_params params;
+      params.cancelled = session_closed_flag(res);
+      params.speculative =
+          spec_mode_from_str(json_value(body_js, "speculative", std::string()));
+      params.n_predict = n_predict;
+      params.stop = stop_strings_from_json(body_js);
+      params.sampling = sampling_params_from_json(body_js, vocab, sampling);
+      if (!model_general.prepare_sampling(params.sampling))
+        HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                                 "invalid grammar or json schema");
+      gen_stats stats;
+      context_gen_text_until_eog(model_general.get_scheduler(), tokens,
+                                 get_text_hdl, params, &stats);
       json body_js;
       body_js["content"] = res_body;
+      body_js["usage"] = {
+          {"prompt_tokens", tokens.size()},
+          {"completion_tokens", stats.n_predicted},
+          {"accepted_prediction_tokens", stats.n_draft_accepted},
+          {"rejected_prediction_tokens",
+           stats.n_draft - stats.n_draft_accepted}};
       res->set_content(body_js.dump());
       res->end();
       return;
@@ -1939,31 +2394,97 @@ void server_cmd_handler(std::filesystem::path model_path) {
     res->endend();
   };
 
+  // KV snapshots of a slot: {"filename": "..."} under <app data>/slots
+  static auto slot_file_handler = [&model_general](
+                                      std::shared_ptr<http::response> res,
+                                      bool is_save) {
+    if (!model_general.is_initialized())
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
+                               "Model is not initialized");
+
+    int slot_id = -1;
+    try {
+      slot_id = std::stoi(res->reqwest().get_param("id"));
+    } catch (const std::exception &) {
+    }
+    if (slot_id < 0 || slot_id >= model_general.get_scheduler().get_n_seq())
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid slot id");
+
+    json body_ = json_parse(res->reqwest().body());
+    std::string filename = json_value(body_, "filename", std::string());
+    if (filename.empty() ||
+        std::filesystem::path(filename).filename() != filename ||
+        filename == "." || filename == "..")
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
+                               "invalid filename");
+
+    std::filesystem::path dir = app_data_path / "slots";
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    std::string path = (dir / filename).generic_string();
+    if (!is_save && !std::filesystem::exists(path))
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::not_found,
+                               "file not found");
+
+    batch_scheduler &sched = model_general.get_scheduler();
+    auto t_start = std::chrono::steady_clock::now();
+    int n_token = is_save ? sched.save_slot(slot_id, path)
+                          : sched.restore_slot(slot_id, path);
+    double t_ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - t_start)
+                      .count();
+    if (n_token < 0)
+      HTTP_SEND_RES_AND_RETURN(res, http::status_code::internal_server_error,
+                               is_save ? "failed to save the slot"
+                                       : "failed to restore the slot");
+
+    json data = {{"id_slot", slot_id},
+                 {"filename", filename},
+                 {is_save ? "n_saved" : "n_restored", n_token},
+                 {"timings", {{is_save ? "save_ms" : "restore_ms", t_ms}}}};
+    res->set_content(data.dump(), MIMETYPE_JSON);
+    res->endend();
+  };
+
+  static auto slot_save_handler = [](std::shared_ptr<http::response> res,
+                                     int) { slot_file_handler(res, true); };
+  static auto slot_restore_handler = [](std::shared_ptr<http::response> res,
+                                        int) { slot_file_handler(res, false); };
+
   struct process_request_ {
     using function_handler =
         std::function<void(std::shared_ptr<http::response>, int)>;
     using task = std::tuple<function_handler, std::shared_ptr<http::response>>;
 
-    process_request_(model_general_t &model_general_)
-        : model_general(model_general_) {}
+    process_request_(int n_workers_) : n_workers(n_workers_) {}
+
+    // one worker per slot (or per pooled embedding context). for generation
+    // the slot itself is picked by the batch scheduler once the prompt is
+    // known, the decoding of all slots is merged there
+    void start() {
+      for (int i = 0; i < n_workers; i++)
+        workers.emplace_back(&process_request_::loop, this, i);
+    }
+
+    void join() {
+      for (auto &th : workers) th.join();
+    }
 
-    void loop() {
-      const int n_ctx = model_general.get_n_ctx();
+    void loop(int worker_id) {
       while (true) {
-        {
-          std::unique_lock lk(mt);
-          cv.wait(lk, [&]() { return !tasks.empty(); });
-        }
-        for (int i = 0; i < n_ctx && !tasks.empty(); i++) {
-          llama_context *ctx = model_general.get_context(i);
-
-          std::unique_lock lk(mt);
-          auto func_ = std::get<0>(tasks.front());
-          auto res = std::get<1>(tasks.front());
-          tasks.pop();
-          lk.unlock();
-          func_(res, i);  // process the request
-        }
+        std::unique_lock lk(mt);
+        cv.wait(lk, [&]() { return !tasks.empty(); });
+        auto func_ = std::get<0>(tasks.front());
+        auto res = std::get<1>(tasks.front());
+        tasks.pop();
+        n_busy++;
+        lk.unlock();
+
+        func_(res, worker_id);  // process the request
+
+        lk.lock();
+        n_busy--;
       }
     }
 
@@ -1973,24 +2494,42 @@ void server_cmd_handler(std::filesystem::path model_path) {
       task task_ = std::make_tuple(func_, res_);
       {
         std::lock_guard lk(mt);
+        // backpressure: all workers are busy and the queue is full
+        if (xoptions_.n_queue_max > 0 &&
+            (int)tasks.size() >= xoptions_.n_queue_max) {
+          AVLLM_LOG_WARN("%s: queue is full (%zu waiting, %d busy)\n",
+                         __func__, tasks.size(), n_busy);
+          HTTP_SEND_RES_AND_RETURN(res_,
+                                   http::status_code::service_unavailable,
+                                   "Server is busy, try again later");
+        }
         tasks.push(task_);
         cv.notify_one();  // notify the worker to process the task
       }
     }
 
-    model_general_t &model_general;
+    int n_workers;
+    std::vector<std::thread> workers;
     std::queue<task> tasks;  // queue for responses
+    int n_busy = 0;          // workers running a request
     std::mutex mt;
     std::condition_variable cv;
-  } process_request(model_general);
-
-  auto embedding_model_handler = [&model_embedding, &embedding_handler](
+  } process_request(model_general.get_n_ctx()),
+      // with micro-batching, enough workers to fill a batch
+      process_embedding(xoptions_.emb_batch_ms > 0
+                            ? std::max(embedding_pool.size(),
+                                       cparams_emb.n_parallel)
+                            : embedding_pool.size());
+
+  // embeddings run on their own queue, off the http thread
+  auto embedding_model_handler = [&model_embedding, &embedding_handler,
+                                  &process_embedding](
                                      std::shared_ptr<http::response> res) {
     if (!model_embedding)
       HTTP_SEND_RES_AND_RETURN(
           res, http::status_code::internal_server_error,
           "not support. the model is not inialized as request");
-    embedding_handler(res);
+    process_embedding(std::ref(embedding_handler), res);
   };
 
   auto oaicompact_to_text_handler = [&model_general](
@@ -2006,8 +2545,8 @@ void server_cmd_handler(std::filesystem::path model_path) {
       HTTP_SEND_RES_AND_RETURN(res, http::status_code::bad_request,
                                "invalid request body");
 
-    std::string text =
-        model_oaicompact_to_text(model_general.model_ptr.get(), body_js);
+    std::string text = model_oaicompact_to_text(
+        model_general.chat_templates_ptr.get(), body_js);
     res->set_content(text);
     res->endend();
   };
@@ -2062,13 +2601,21 @@ void server_cmd_handler(std::filesystem::path model_path) {
 		route_.post("/model/oai_to_text",    std::ref(oaicompact_to_text_handler));
 		// llama.cpp
     route_.get("/props",                 std::ref(props_handler));
+    route_.post("/slots/{id}/save",      [&process_request](std::shared_ptr<http::response> res) {
+				process_request(std::ref(slot_save_handler), res);
+		});
+    route_.post("/slots/{id}/restore",   [&process_request](std::shared_ptr<http::response> res) {
+				process_request(std::ref(slot_restore_handler), res);
+		});
   // clang-format on
 
   AVLLM_LOG_INFO("Server can be accessed at http://127.0.0.1:%d\n",
                  xoptions_.port);
 
-  std::thread th(&process_request_::loop, &process_request);
+  process_request.start();
+  process_embedding.start();
 
   http::start_server(xoptions_.port, route_);
-  th.join();
+  process_request.join();
+  process_embedding.join();
 };
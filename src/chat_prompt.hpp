@@ -0,0 +1,140 @@
+#ifndef _AVLLM_CHAT_PROMPT_H_
+#define _AVLLM_CHAT_PROMPT_H_
+
+#include "llama.h"
+#include "lru_cache.hpp"
+#include "token_cache.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace av_llm {
+
+// the tokens of rendered chat prompts keyed by the hash of their messages,
+// least recently used first out. the next turn of a conversation starts
+// with the messages of the previous one: its prompt is checked to start
+// with the cached text, whose tokens are reused up to its last special
+// token, only the text after it is tokenized. a new conversation reuses the
+// tokens of its first message (the system prompt and the tools in the
+// usual templates) the same way. the tokenizer cuts the text at the special
+// tokens before it merges, so the tokens before a special token are those
+// of the text before it whatever follows; elsewhere a merge across the
+// split could give other tokens than the whole text
+class chat_prompt_cache {
+ public:
+  explicit chat_prompt_cache(size_t capacity = 64) : cache(capacity) {}
+
+  // hashes[k] is the hash of the first k messages, salt covers what else
+  // goes into the render (tools, template options)
+  static std::vector<size_t> prefix_hashes(const nlohmann::ordered_json &msgs,
+                                           const std::string &salt) {
+    std::vector<size_t> hashes;
+    size_t h = std::hash<std::string>{}(salt);
+    hashes.push_back(h);
+    for (const auto &msg : msgs) {
+      h ^= std::hash<std::string>{}(msg.dump()) + 0x9e3779b9 + (h << 6) +
+           (h >> 2);
+      hashes.push_back(h);
+    }
+    return hashes;
+  }
+
+  // the tokens of the prompt rendered from the messages of hashes, stored
+  // for the next turn under the hash of all the messages. render_head
+  // renders the first message alone, it is called when nothing is cached.
+  // n_cached (if set) gets the number of tokens taken from the cache
+  std::vector<llama_token> tokenize(
+      const llama_vocab *vocab, const std::string &prompt,
+      const std::vector<size_t> &hashes,
+      const std::function<std::string()> &render_head = nullptr,
+      size_t *n_cached = nullptr) {
+    std::vector<llama_token> tokens;
+    size_t n_text = 0;
+    {
+      std::lock_guard lk(mt);
+      // the longest cached turn, a shorter one when the prompt doesn't
+      // start with it or it has no special token to cut at
+      for (size_t k = hashes.size(); k-- > 1 && n_text == 0;) {
+        const entry *e = cache.get(hashes[k]);
+        if (!e || e->n_cut_text == 0 ||
+            prompt.compare(0, e->text.size(), e->text) != 0)
+          continue;
+
+        tokens.assign(e->tokens.begin(), e->tokens.begin() + e->n_cut_tokens);
+        n_text = e->n_cut_text;
+      }
+    }
+
+    if (n_text == 0 && render_head && hashes.size() > 2) {
+      std::string head = render_head();
+      if (!head.empty() && head.size() < prompt.size() &&
+          prompt.compare(0, head.size(), head) == 0) {
+        entry e =
+            make_entry(vocab, head, tokenize_text(vocab, head, true, true));
+        tokens.assign(e.tokens.begin(), e.tokens.begin() + e.n_cut_tokens);
+        n_text = e.n_cut_text;
+        std::lock_guard lk(mt);
+        cache.put(hashes[1], std::move(e));
+      }
+    }
+    if (n_cached) *n_cached = tokens.size();
+
+    if (n_text == 0) {
+      tokens = tokenize_text(vocab, prompt, true, true);
+    } else if (n_text < prompt.size()) {
+      std::vector<llama_token> rest = tokenize_text(
+          vocab, std::string_view(prompt).substr(n_text), false, true);
+      tokens.insert(tokens.end(), rest.begin(), rest.end());
+    }
+
+    entry e = make_entry(vocab, prompt, tokens);
+    std::lock_guard lk(mt);
+    cache.put(hashes.back(), std::move(e));
+    return tokens;
+  }
+
+ private:
+  struct entry {
+    std::string text;
+    std::vector<llama_token> tokens;
+    // the tokens up to the last special token and the length of their text
+    size_t n_cut_tokens;
+    size_t n_cut_text;
+  };
+
+  // the entry of text, cut after its last special token. a special token
+  // added by the tokenizer (BOS) is not in the text, it is skipped
+  static entry make_entry(const llama_vocab *vocab, const std::string &text,
+                          std::vector<llama_token> tokens) {
+    entry e{text, std::move(tokens), 0, 0};
+    size_t pos = 0;
+    char piece[256];
+    for (size_t i = 0; i < e.tokens.size(); i++) {
+      if ((llama_vocab_get_attr(vocab, e.tokens[i]) &
+           (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED)) == 0)
+        continue;
+      int n = llama_token_to_piece(vocab, e.tokens[i], piece, sizeof(piece),
+                                   0, true);
+      if (n <= 0) continue;
+      size_t at = text.find(std::string_view(piece, n), pos);
+      if (at == std::string::npos) continue;
+
+      pos = at + n;
+      e.n_cut_tokens = i + 1;
+      e.n_cut_text = pos;
+    }
+    return e;
+  }
+
+  lru_cache<size_t, entry> cache;  // guarded by mt
+  std::mutex mt;
+};
+
+}  // namespace av_llm
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef _AVLLM_DETOKENIZER_H_
+#define _AVLLM_DETOKENIZER_H_
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace av_llm {
+
+// the pieces of the whole vocab, built once per model. the pieces are
+// stored back to back in one arena, piece i is [offsets[i], offsets[i+1])
+class piece_table {
+ public:
+  piece_table() = default;
+  explicit piece_table(const llama_vocab *vocab) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    offsets.resize(n_vocab + 1);
+
+    std::vector<char> buf(64);
+    for (llama_token token = 0; token < n_vocab; token++) {
+      offsets[token] = arena.size();
+      int n = llama_token_to_piece(vocab, token, buf.data(), buf.size(), 0,
+                                   true);
+      if (n < 0) {  // longer than the buffer
+        buf.resize(-n);
+        n = llama_token_to_piece(vocab, token, buf.data(), buf.size(), 0, true);
+      }
+      if (n > 0) arena.append(buf.data(), n);
+    }
+    offsets[n_vocab] = arena.size();
+  }
+
+  // the given pieces, token i is pieces[i]
+  explicit piece_table(const std::vector<std::string> &pieces) {
+    offsets.reserve(pieces.size() + 1);
+    for (const std::string &piece : pieces) {
+      offsets.push_back(arena.size());
+      arena += piece;
+    }
+    offsets.push_back(arena.size());
+  }
+
+  std::string_view piece(llama_token token) const {
+    if (token < 0 || token + 1 >= (llama_token)offsets.size()) return {};
+    return std::string_view(arena).substr(
+        offsets[token], offsets[token + 1] - offsets[token]);
+  }
+
+  size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+ private:
+  std::string arena;
+  std::vector<uint32_t> offsets;
+};
+
+// turns a stream of tokens into text. a UTF-8 character split across
+// tokens is held back until its last byte arrives, so every returned text
+// is valid to send on its own
+class detokenizer {
+ public:
+  explicit detokenizer(const piece_table *table_ = nullptr) : table(table_) {}
+
+  // the text completed by the token, valid until the next call
+  const std::string &push(llama_token token) {
+    pending.append(table->piece(token));
+    size_t n = complete_len(pending);
+    out.assign(pending, 0, n);
+    pending.erase(0, n);
+    return out;
+  }
+
+  // the bytes held back at the end of the stream
+  const std::string &flush() {
+    out.swap(pending);
+    pending.clear();
+    return out;
+  }
+
+  // the length of the prefix of s made of complete UTF-8 characters.
+  // invalid bytes are not held back
+  static size_t complete_len(std::string_view s) {
+    size_t n = s.size();
+    for (size_t i = 1; i <= 3 && i <= n; i++) {
+      unsigned char c = s[n - i];
+      if ((c & 0xc0) == 0x80) continue;  // continuation byte
+
+      size_t len = (c & 0xe0) == 0xc0   ? 2
+                   : (c & 0xf0) == 0xe0 ? 3
+                   : (c & 0xf8) == 0xf0 ? 4
+                                        : 1;
+      return len > i ? n - i : n;
+    }
+    return n;
+  }
+
+ private:
+  const piece_table *table;
+  std::string pending;
+  std::string out;
+};
+
+}  // namespace av_llm
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef _AVLLM_KV_HOST_CACHE_H_
+#define _AVLLM_KV_HOST_CACHE_H_
+
+#include "llama.h"
+#include "lru_cache.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace av_llm {
+
+// second tier of the prefix cache: the serialized KV of sequences evicted
+// from their slot, kept in host memory. a state covers whole blocks of
+// n_block tokens and is indexed by the rolling hash of each of its block
+// prefixes, so a prompt which shares only the first blocks still hits.
+// bounded by capacity bytes, least recently used first out. not thread
+// safe, the scheduler thread owns it
+class kv_host_cache {
+ public:
+  explicit kv_host_cache(size_t capacity, size_t n_block_ = 256)
+      : n_block(n_block_),
+        entries(
+            capacity, [](const entry &e) { return e.size; },
+            [this](size_t, const entry &e) { unindex(e); }) {}
+  kv_host_cache(const kv_host_cache &) = delete;
+  kv_host_cache &operator=(const kv_host_cache &) = delete;
+
+  size_t block_size() const { return n_block; }
+
+  // the longest cached prefix of tokens, in whole blocks and at most n_max
+  // tokens, with the state holding it. the state may cover more tokens
+  std::pair<size_t, const std::vector<uint8_t> *> find(
+      const std::vector<llama_token> &tokens, size_t n_max) {
+    std::vector<size_t> hashes = block_hashes(tokens, n_max);
+    for (size_t k = hashes.size(); k > 0; k--) {
+      auto it = index.find(hashes[k - 1]);
+      if (it == index.end()) continue;
+
+      const entry *e = entries.get(it->second);
+      size_t n = k * n_block;
+      if (!e || !std::equal(tokens.begin(), tokens.begin() + n,
+                            e->tokens.begin()))
+        continue;  // hash collision
+      return {n, &e->state};
+    }
+    return {0, nullptr};
+  }
+
+  // whether the first n tokens (whole blocks) are cached
+  bool contains(const std::vector<llama_token> &tokens, size_t n) {
+    return find(tokens, n).first == n;
+  }
+
+  // the state of a sequence holding tokens, whole blocks
+  void put(const std::vector<llama_token> &tokens,
+           std::vector<uint8_t> state) {
+    if (tokens.size() < n_block) return;
+
+    entry e{tokens, std::move(state), 0, block_hashes(tokens, tokens.size())};
+    e.size = e.state.size() + tokens.size() * sizeof(llama_token);
+    size_t key = e.hashes.back();
+    const entry *stored = entries.put(key, std::move(e));
+    if (!stored) return;  // larger than the capacity
+    for (size_t h : stored->hashes) index[h] = key;  // the newest wins
+  }
+
+  size_t size_bytes() const { return entries.used_capacity(); }
+
+ private:
+  struct entry {
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> state;
+    size_t size;
+    std::vector<size_t> hashes;
+  };
+
+  // hashes[k] identifies the first k+1 blocks of tokens
+  std::vector<size_t> block_hashes(const std::vector<llama_token> &tokens,
+                                   size_t n_max) const {
+    std::vector<size_t> hashes;
+    size_t h = 0;
+    size_t n = std::min(n_max, tokens.size()) / n_block * n_block;
+    for (size_t i = 0; i < n; i++) {
+      h ^= std::hash<llama_token>{}(tokens[i]) + 0x9e3779b9 + (h << 6) +
+           (h >> 2);
+      if ((i + 1) % n_block == 0) hashes.push_back(h);
+    }
+    return hashes;
+  }
+
+  // the block prefixes of a leaving entry which still point to it
+  void unindex(const entry &e) {
+    size_t key = e.hashes.back();
+    for (size_t h : e.hashes) {
+      auto it = index.find(h);
+      if (it != index.end() && it->second == key) index.erase(it);
+    }
+  }
+
+  size_t n_block;
+  // the entries by the hash of all their blocks, and the entry of each
+  // block prefix
+  lru_cache<size_t, entry> entries;
+  std::unordered_map<size_t, size_t> index;
+};
+
+}  // namespace av_llm
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef _AVLLM_LRU_CACHE_H_
+#define _AVLLM_LRU_CACHE_H_
+
+#include <functional>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace av_llm {
+
+// values by key, least recently used first out. each value takes cost(value)
+// of the capacity, 1 when cost is not set: the capacity is then a number of
+// entries. on_evict (if set) sees every entry leaving the cache, replaced
+// ones included. not thread safe, the owner locks
+template <typename K, typename V, typename Hash = std::hash<K>>
+class lru_cache {
+ public:
+  using cost_fn = std::function<size_t(const V &)>;
+  using evict_fn = std::function<void(const K &, const V &)>;
+
+  explicit lru_cache(size_t capacity_, cost_fn cost_ = nullptr,
+                     evict_fn on_evict_ = nullptr)
+      : capacity(capacity_),
+        cost(std::move(cost_)),
+        on_evict(std::move(on_evict_)) {}
+
+  // the value of the key, nullptr when it is not cached. a hit becomes the
+  // most recently used entry
+  V *get(const K &key) {
+    auto it = index.find(key);
+    if (it == index.end()) return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return &it->second->value;
+  }
+
+  bool contains(const K &key) const { return index.count(key) > 0; }
+
+  // store the value in place of the one of the key, the least recently used
+  // entries make room for it. nullptr when it is larger than the capacity
+  V *put(const K &key, V value) {
+    size_t size = cost ? cost(value) : 1;
+    erase(key);
+    if (size > capacity) return nullptr;
+
+    while (!lru.empty() && used + size > capacity) remove(std::prev(lru.end()));
+    lru.push_front({key, std::move(value), size});
+    index[key] = lru.begin();
+    used += size;
+    return &lru.front().value;
+  }
+
+  void erase(const K &key) {
+    auto it = index.find(key);
+    if (it != index.end()) remove(it->second);
+  }
+
+  size_t size() const { return lru.size(); }
+
+  // the capacity taken by the entries
+  size_t used_capacity() const { return used; }
+
+ private:
+  struct entry {
+    K key;
+    V value;
+    size_t size;
+  };
+
+  void remove(typename std::list<entry>::iterator it) {
+    if (on_evict) on_evict(it->key, it->value);
+    used -= it->size;
+    index.erase(it->key);
+    lru.erase(it);
+  }
+
+  size_t capacity;
+  cost_fn cost;
+  evict_fn on_evict;
+  size_t used = 0;
+  std::list<entry> lru;
+  std::unordered_map<K, typename std::list<entry>::iterator, Hash> index;
+};
+
+}  // namespace av_llm
+
+#endif
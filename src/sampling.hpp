@@ -0,0 +1,200 @@
+#ifndef _AVLLM_SAMPLING_H_
+#define _AVLLM_SAMPLING_H_
+
+#include "json-schema-to-grammar.h"
+#include "llama-cpp.h"
+#include "llama.h"
+#include "log.hpp"
+#include "lru_cache.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace av_llm {
+
+// sampling options of a request. the defaults are greedy decoding
+struct sampling_params {
+  float temperature = 0.0f;  // <= 0: greedy
+  int32_t top_k = 40;        // <= 0: disabled
+  float top_p = 1.0f;
+  float min_p = 0.0f;
+
+  int32_t penalty_last_n = 64;
+  float repeat_penalty = 1.0f;  // 1.0: disabled
+  float presence_penalty = 0.0f;
+  float frequency_penalty = 0.0f;
+
+  uint32_t seed = LLAMA_DEFAULT_SEED;
+  std::vector<llama_logit_bias> logit_bias;
+
+  // constrained decoding, at most one of them
+  std::string grammar;      // GBNF
+  std::string json_schema;  // serialized JSON schema
+
+  bool operator==(const sampling_params &other) const {
+    if (logit_bias.size() != other.logit_bias.size()) return false;
+    for (size_t i = 0; i < logit_bias.size(); i++)
+      if (logit_bias[i].token != other.logit_bias[i].token ||
+          logit_bias[i].bias != other.logit_bias[i].bias)
+        return false;
+
+    return temperature == other.temperature && top_k == other.top_k &&
+           top_p == other.top_p && min_p == other.min_p &&
+           penalty_last_n == other.penalty_last_n &&
+           repeat_penalty == other.repeat_penalty &&
+           presence_penalty == other.presence_penalty &&
+           frequency_penalty == other.frequency_penalty &&
+           seed == other.seed && grammar == other.grammar &&
+           json_schema == other.json_schema;
+  }
+  bool operator!=(const sampling_params &other) const {
+    return !(*this == other);
+  }
+};
+
+// compiled grammar samplers keyed by the GBNF or the JSON schema, least
+// recently used first out. a hit skips the schema to GBNF
+// conversion and the GBNF parsing, the request gets a clone of the sampler
+class grammar_cache {
+ public:
+  explicit grammar_cache(size_t capacity = 64) : cache(capacity) {}
+
+  // a fresh grammar sampler for the params, nullptr when the schema or the
+  // grammar is invalid
+  llama_sampler *clone(const llama_vocab *vocab,
+                       const sampling_params &params) {
+    std::lock_guard lk(mt);
+    llama_sampler *proto = get(vocab, params);
+    return proto ? llama_sampler_clone(proto) : nullptr;
+  }
+
+  // compile and cache the grammar of the params, false when it is invalid
+  bool prepare(const llama_vocab *vocab, const sampling_params &params) {
+    std::lock_guard lk(mt);
+    return get(vocab, params) != nullptr;
+  }
+
+ private:
+  llama_sampler *get(const llama_vocab *vocab, const sampling_params &params) {
+    std::string key = params.json_schema.empty() ? "g:" + params.grammar
+                                                 : "s:" + params.json_schema;
+    if (llama_sampler_ptr *smpl = cache.get(key)) return smpl->get();
+
+    std::string gbnf = params.grammar;
+    if (!params.json_schema.empty()) {
+      try {
+        gbnf = json_schema_to_grammar(
+            nlohmann::ordered_json::parse(params.json_schema));
+      } catch (const std::exception &e) {
+        AVLLM_LOG_WARN("%s: invalid json schema: %s\n", __func__, e.what());
+        return nullptr;
+      }
+    }
+
+    llama_sampler *smpl =
+        llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+    if (!smpl) {
+      AVLLM_LOG_WARN("%s: failed to parse the grammar\n", __func__);
+      return nullptr;
+    }
+    return cache.put(key, llama_sampler_ptr(smpl))->get();
+  }
+
+  lru_cache<std::string, llama_sampler_ptr> cache;  // guarded by mt
+  std::mutex mt;
+};
+
+// the grammar sampler of the constrained output, nullptr when the request
+// has none or it doesn't parse
+inline llama_sampler *grammar_init(const llama_vocab *vocab,
+                                   const sampling_params &params,
+                                   grammar_cache *grammars = nullptr) {
+  if (params.grammar.empty() && params.json_schema.empty()) return nullptr;
+  if (grammars) return grammars->clone(vocab, params);
+  if (!params.json_schema.empty()) return nullptr;
+  return llama_sampler_init_grammar(vocab, params.grammar.c_str(), "root");
+}
+
+// build the sampler chain: logit bias, penalties, then greedy or
+// top_k/top_p/min_p/temperature/dist. the grammar is apart, sampler_sample
+// applies it
+inline llama_sampler *sampler_init(const llama_vocab *vocab,
+                                   const sampling_params &params) {
+  auto sparams = llama_sampler_chain_default_params();
+  sparams.no_perf = false;
+  llama_sampler *smpl = llama_sampler_chain_init(sparams);
+  if (!smpl) return nullptr;
+
+  if (!params.logit_bias.empty())
+    llama_sampler_chain_add(
+        smpl, llama_sampler_init_logit_bias(llama_vocab_n_tokens(vocab),
+                                            params.logit_bias.size(),
+                                            params.logit_bias.data()));
+
+  if (params.repeat_penalty != 1.0f || params.presence_penalty != 0.0f ||
+      params.frequency_penalty != 0.0f)
+    llama_sampler_chain_add(
+        smpl, llama_sampler_init_penalties(
+                  params.penalty_last_n, params.repeat_penalty,
+                  params.frequency_penalty, params.presence_penalty));
+
+  if (params.temperature <= 0.0f) {
+    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    return smpl;
+  }
+
+  if (params.top_k > 0)
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(params.top_k));
+  if (params.top_p < 1.0f)
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(params.top_p, 1));
+  if (params.min_p > 0.0f)
+    llama_sampler_chain_add(smpl, llama_sampler_init_min_p(params.min_p, 1));
+  llama_sampler_chain_add(smpl, llama_sampler_init_temp(params.temperature));
+  llama_sampler_chain_add(smpl, llama_sampler_init_dist(params.seed));
+  return smpl;
+}
+
+// sample the token of the logits of the batch entry idx. the chain samples
+// first and the grammar checks that token alone; the grammar runs over the
+// whole vocab only when it rejects the token, then the chain samples again
+// from what the grammar allows. both accept the token
+inline llama_token sampler_sample(llama_sampler *chain, llama_sampler *grammar,
+                                  llama_context *ctx, int idx) {
+  const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+  const int n_vocab = llama_vocab_n_tokens(vocab);
+  const float *logits = llama_get_logits_ith(ctx, idx);
+
+  thread_local std::vector<llama_token_data> cur;
+  auto candidates = [&]() {
+    cur.resize(n_vocab);
+    for (llama_token token = 0; token < n_vocab; token++)
+      cur[token] = {token, logits[token], 0.0f};
+    return llama_token_data_array{cur.data(), cur.size(), -1, false};
+  };
+
+  llama_token_data_array cur_p = candidates();
+  llama_sampler_apply(chain, &cur_p);
+  llama_token token = cur_p.data[cur_p.selected].id;
+
+  if (grammar) {
+    llama_token_data single = {token, 1.0f, 0.0f};
+    llama_token_data_array single_p = {&single, 1, -1, false};
+    llama_sampler_apply(grammar, &single_p);
+    if (std::isinf(single.logit)) {  // rejected
+      cur_p = candidates();
+      llama_sampler_apply(grammar, &cur_p);
+      llama_sampler_apply(chain, &cur_p);
+      token = cur_p.data[cur_p.selected].id;
+    }
+    llama_sampler_accept(grammar, token);
+  }
+  llama_sampler_accept(chain, token);
+  return token;
+}
+
+}  // namespace av_llm
+
+#endif
@@ -0,0 +1,1355 @@
+#ifndef _AVLLM_SCHEDULER_H_
+#define _AVLLM_SCHEDULER_H_
+
+#include "common.h"
+#include "detokenizer.hpp"
+#include "kv_host_cache.hpp"
+#include "llama-cpp.h"
+#include "llama.h"
+#include "log.hpp"
+#include "sampling.hpp"
+#include "state_files.hpp"
+#include "stop_matcher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace av_llm {
+
+// speculative decoding of a request
+enum class spec_mode {
+  standard,  // with the draft model when one is loaded
+  none,
+  ngram,  // prompt lookup: continuations copied from the prompt and output
+};
+
+// "speculative" field of a request: "none", "ngram", otherwise the default
+inline spec_mode spec_mode_from_str(const std::string &str) {
+  if (str == "none") return spec_mode::none;
+  if (str == "ngram") return spec_mode::ngram;
+  return spec_mode::standard;
+}
+
+// what to do when a sequence outgrows its context
+enum class ctx_overflow {
+  shift,            // discard the oldest tokens after n_keep, go on
+  truncate_prompt,  // cut the middle of a prompt too long, the output stops
+                    // at the end of the context
+  error,
+};
+
+// --ctx-overflow: "shift", "truncate-prompt", otherwise "error"
+inline ctx_overflow ctx_overflow_from_str(const std::string &str) {
+  if (str == "shift") return ctx_overflow::shift;
+  if (str == "truncate-prompt") return ctx_overflow::truncate_prompt;
+  return ctx_overflow::error;
+}
+
+// discard n_discard positions of the sequence after the first n_keep and
+// move the following ones down. false when the memory can't shift
+inline bool context_shift(llama_memory_t mem, llama_seq_id seq_id, int n_keep,
+                          int n_discard) {
+  if (!llama_memory_can_shift(mem)) return false;
+  llama_memory_seq_rm(mem, seq_id, n_keep, n_keep + n_discard);
+  llama_memory_seq_add(mem, seq_id, n_keep + n_discard, -1, -n_discard);
+  return true;
+}
+
+// a prompt which doesn't fit in n_ctx keeps its first n_keep tokens (up to
+// half of the context) and the latest ones, the middle is cut so that
+// discard of the rest stays free. the number of tokens cut
+inline int truncate_prompt_tokens(std::vector<llama_token> &prompt, int n_ctx,
+                                  int n_keep, float discard) {
+  if ((int)prompt.size() < n_ctx) return 0;
+
+  int n_keep_ctx = std::min(n_keep, n_ctx / 2);
+  int n_tail = std::max(1, (int)((n_ctx - n_keep_ctx) * (1.0f - discard)));
+  int n_erase = (int)prompt.size() - n_keep_ctx - n_tail;
+  prompt.erase(prompt.begin() + n_keep_ctx,
+               prompt.begin() + n_keep_ctx + n_erase);
+  return n_erase;
+}
+
+// per-request options of a generation
+struct gen_params {
+  std::string session_id;  // sticky slot affinity ("user" / "session_id")
+  bool append = false;     // continue on the KV of the session's slot
+  spec_mode speculative = spec_mode::standard;
+  sampling_params sampling;
+  int n_predict = -1;              // max generated tokens, <= 0: no limit
+  std::vector<std::string> stop;   // stop strings, not part of the output
+  bool is_stop_inclusive = false;  // the output ends with the stop string
+  bool is_logprob = false;         // sum the log probabilities of the output
+  // set when the client is gone, the sequence is dropped at the next step
+  std::shared_ptr<std::atomic<bool>> cancelled;
+};
+
+// per-request statistics reported back to the handler
+struct gen_stats {
+  int slot_id = -1;
+  int n_prompt_cached = 0;    // prompt tokens reused from the slot's KV
+  int n_draft = 0;            // speculative tokens proposed
+  int n_draft_accepted = 0;   // speculative tokens accepted by the target
+  int n_predicted = 0;        // generated tokens
+  float logprob = 0.0f;       // of the generated tokens, with is_logprob
+  std::string finish_reason;  // "stop" or "length", empty on error
+};
+
+// bookkeeping of the sequences (slots) of the shared context. a request is
+// routed to the slot of its session, else to the free slot with the longest
+// matching prefix, else to the least recently used free slot.
+class slot_manager {
+ public:
+  explicit slot_manager(int n_slot) : slots(n_slot) {}
+
+  // block until a slot is free. is_session_hit tells whether the slot
+  // already belongs to the session
+  int acquire(const std::vector<llama_token> &prompt_tokens,
+              const std::string &session_id, bool *is_session_hit = nullptr) {
+    std::unique_lock lk(mt);
+    cv.wait(lk, [this]() { return n_free() > 0; });
+    return pick(prompt_tokens, session_id, is_session_hit);
+  }
+
+  // block until n slots are free and take them at once, the first one as
+  // acquire() would pick it. n must not exceed the number of slots
+  std::vector<int> acquire_n(const std::vector<llama_token> &prompt_tokens,
+                             const std::string &session_id, int n,
+                             bool *is_session_hit = nullptr) {
+    std::unique_lock lk(mt);
+    cv.wait(lk, [this, n]() { return n_free() >= n; });
+    std::vector<int> result;
+    result.push_back(pick(prompt_tokens, session_id, is_session_hit));
+    while ((int)result.size() < n) result.push_back(pick({}, "", nullptr));
+    return result;
+  }
+
+  // block until the given slot is free and take it
+  void acquire_id(int slot_id) {
+    std::unique_lock lk(mt);
+    cv.wait(lk, [this, slot_id]() { return !slots[slot_id].busy; });
+    slots[slot_id].busy = true;
+  }
+
+  // take the least recently used free slot which holds tokens, -1 if none.
+  // the caller drops its KV to make room in a unified KV, then releases it
+  int acquire_idle() {
+    std::lock_guard lk(mt);
+    int best = -1;
+    for (int i = 0; i < (int)slots.size(); i++) {
+      if (slots[i].busy || slots[i].tokens.empty()) continue;
+      if (best < 0 || slots[i].t_last_use < slots[best].t_last_use) best = i;
+    }
+    if (best >= 0) slots[best].busy = true;
+    return best;
+  }
+
+  // the KV of the slot no longer holds its session
+  void forget_session(int slot_id) {
+    std::lock_guard lk(mt);
+    slots[slot_id].session_id.clear();
+  }
+
+  // is_used: the slot was used, it becomes the most recently used one.
+  // a slot whose KV was dropped keeps its time and is picked first
+  void release(int slot_id, bool is_used = true) {
+    std::lock_guard lk(mt);
+    slots[slot_id].busy = false;
+    if (is_used) slots[slot_id].t_last_use = std::chrono::steady_clock::now();
+    cv.notify_all();  // acquire_n may wait for more than one
+  }
+
+  // tokens held in the KV of the slot. only the owner of a busy slot (the
+  // scheduler thread) touches them
+  std::vector<llama_token> &tokens(int slot_id) {
+    return slots[slot_id].tokens;
+  }
+
+  // the sampler chain of the slot for the request, and its grammar (if
+  // any) in *grammar. they are reset when the options are the same as the
+  // previous request's, rebuilt otherwise. nullptr when the grammar doesn't
+  // parse. only the owner of the busy slot calls it
+  llama_sampler *sampler(int slot_id, const llama_vocab *vocab,
+                         const sampling_params &params,
+                         grammar_cache *grammars, llama_sampler **grammar) {
+    slot &s = slots[slot_id];
+    if (s.smpl && s.smpl_params == params) {
+      llama_sampler_reset(s.smpl.get());
+      if (s.smpl_grammar) llama_sampler_reset(s.smpl_grammar.get());
+    } else {
+      s.smpl = llama_sampler_ptr(sampler_init(vocab, params));
+      s.smpl_grammar =
+          llama_sampler_ptr(grammar_init(vocab, params, grammars));
+      s.smpl_params = params;
+      bool is_constrained =
+          !params.grammar.empty() || !params.json_schema.empty();
+      if (is_constrained && !s.smpl_grammar) s.smpl.reset();
+    }
+    *grammar = s.smpl_grammar.get();
+    return s.smpl.get();
+  }
+
+  static size_t common_prefix(const std::vector<llama_token> &a,
+                              const std::vector<llama_token> &b) {
+    size_t n = 0;
+    size_t n_max = std::min(a.size(), b.size());
+    while (n < n_max && a[n] == b[n]) n++;
+    return n;
+  }
+
+ private:
+  int n_free() const {
+    return std::count_if(slots.begin(), slots.end(),
+                         [](const slot &s) { return !s.busy; });
+  }
+
+  // take the slot of the session, else the free slot with the longest
+  // matching prefix, else the least recently used one. mt is held
+  int pick(const std::vector<llama_token> &prompt_tokens,
+           const std::string &session_id, bool *is_session_hit) {
+    int best = -1;
+    bool hit = false;
+    if (!session_id.empty()) {
+      for (int i = 0; i < (int)slots.size(); i++)
+        if (!slots[i].busy && slots[i].session_id == session_id) {
+          best = i;
+          hit = true;
+          break;
+        }
+    }
+
+    if (best < 0) {
+      size_t best_len = 0;
+      for (int i = 0; i < (int)slots.size(); i++) {
+        if (slots[i].busy) continue;
+        size_t len = common_prefix(slots[i].tokens, prompt_tokens);
+        if (best < 0 || len > best_len ||
+            (len == best_len && slots[i].t_last_use < slots[best].t_last_use)) {
+          best = i;
+          best_len = len;
+        }
+      }
+      if (best_len == 0)
+        AVLLM_LOG_DEBUG("%s: evict slot %d (lru) \n", __func__, best);
+    }
+
+    slots[best].busy = true;
+    // the request overwrites the KV: an anonymous one clears the tag
+    slots[best].session_id = session_id;
+    if (is_session_hit) *is_session_hit = hit;
+    return best;
+  }
+
+  struct slot {
+    bool busy = false;
+    std::string session_id;
+    std::vector<llama_token> tokens;
+    std::chrono::steady_clock::time_point t_last_use;
+    llama_sampler_ptr smpl;
+    llama_sampler_ptr smpl_grammar;
+    sampling_params smpl_params;
+  };
+
+  std::vector<slot> slots;
+  std::mutex mt;
+  std::condition_variable cv;
+};
+
+// a generation request bound to one sequence of the shared context
+struct gen_sequence {
+  llama_seq_id seq_id = 0;
+  std::vector<llama_token> prompt_tokens;
+  std::function<int(int, const std::string &)> func_;
+  llama_sampler *smpl = nullptr;
+  llama_sampler *smpl_grammar = nullptr;  // checked by sampler_sample
+  std::vector<uint8_t> session_state;     // read by the caller, see admit
+  detokenizer detok;
+  stop_matcher stops;
+  int n_predict = -1;
+  bool append = false;  // continue on the KV the sequence already holds
+  bool is_append_requested = false;
+  std::string session_id;
+  bool is_logprob = false;
+  spec_mode speculative = spec_mode::standard;
+  std::shared_ptr<std::atomic<bool>> cancelled;
+  gen_stats stats;
+
+  // parallel sampling: a fork waits for the prompt of its parent to be
+  // decoded, then copies its KV and samples from the same logits
+  gen_sequence *parent = nullptr;
+  std::vector<gen_sequence *> forks;
+
+  // decoding state (owned by the scheduler thread)
+  size_t n_prompt_done = 0;
+  llama_pos n_past = 0;
+  llama_token last_token = LLAMA_TOKEN_NULL;
+  std::vector<llama_token> drafts;  // speculative tokens under verification
+  int i_batch = -1;
+
+  bool done = false;
+  int rc = 0;
+};
+
+// continuous batching: one llama_context, one sequence per slot.
+// each step merges the prefill chunks and the decode tokens of all active
+// sequences into a single llama_decode. sequences join and leave between
+// steps.
+class batch_scheduler {
+ public:
+  batch_scheduler(llama_context *ctx_, int n_seq_)
+      : ctx(ctx_),
+        n_seq(std::max(1, n_seq_)),
+        slots(n_seq),
+        pieces(llama_model_get_vocab(llama_get_model(ctx_))) {
+    n_batch = llama_n_batch(ctx);
+    n_ctx_seq = llama_n_ctx(ctx) / n_seq;
+    batch = llama_batch_init(n_batch, 0, 1);
+    kv_parent.assign(n_seq, -1);
+    n_kv_shared.assign(n_seq, 0);
+  }
+
+  ~batch_scheduler() {
+    stop();
+    llama_batch_free(batch);
+    if (ctx_dft) llama_batch_free(batch_dft);
+  }
+
+  // context overflow: keep the first n_keep tokens of a sequence, discard
+  // the given fraction of the rest
+  void set_ctx_overflow(ctx_overflow mode, int n_keep_, float discard) {
+    overflow = mode;
+    n_keep = std::max(0, n_keep_);
+    ctx_discard = std::clamp(discard, 0.0f, 1.0f);
+  }
+
+  // unified KV: the slots draw their cells from one pool of the size of the
+  // context, a sequence grows up to n_ctx_seq_ tokens. the KV of idle slots
+  // is dropped when the pool runs short
+  void set_kv_unified(int n_ctx_seq_) {
+    n_cells = llama_n_ctx(ctx);
+    n_ctx_seq = std::clamp(n_ctx_seq_, 1, n_cells);
+  }
+
+  // maximum number of tokens proposed per step by speculative decoding
+  void set_n_draft(int n_draft) { n_draft_max = std::max(0, n_draft); }
+
+  // speculative decoding: a draft context with the same sequences proposes
+  // up to n_draft tokens, the target verifies them in the same decode
+  void set_draft(llama_context *ctx_dft_) {
+    ctx_dft = ctx_dft_;
+    batch_dft = llama_batch_init(n_batch, 0, 1);
+    dft_tokens.resize(n_seq);
+
+    auto sparams = llama_sampler_chain_default_params();
+    llama_sampler *smpl = llama_sampler_chain_init(sparams);
+    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    smpl_dft = llama_sampler_ptr(smpl);
+  }
+
+  void start() { th = std::thread(&batch_scheduler::loop, this); }
+
+  void stop() {
+    {
+      std::lock_guard lk(mt);
+      stopped = true;
+      cv.notify_all();
+    }
+    if (th.joinable()) th.join();
+  }
+
+  // persistent sessions: the KV of a session is saved to the directory when
+  // its slot is taken by another one, and restored when the session comes
+  // back. the file name is the hash of the session id
+  void set_session_dir(const std::filesystem::path &dir) {
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec) {
+      AVLLM_LOG_WARN("%s: can't create %s\n", __func__,
+                     dir.generic_string().c_str());
+      return;
+    }
+    session_dir = dir;
+    kv_sessions.assign(n_seq, std::string());
+    files = std::make_unique<state_files>();
+  }
+
+  // second tier of the prefix cache: the KV of prefixes about to be
+  // overwritten in their slot is kept in host memory, up to capacity bytes,
+  // and copied back into the slot of a prompt which starts with it
+  void set_host_cache(size_t capacity) {
+    host_cache = capacity > 0 ? std::make_unique<kv_host_cache>(capacity)
+                              : nullptr;
+  }
+
+  // save the KV and the tokens of the slot to the file once the slot is
+  // free. the scheduler thread copies them, the file is written on the
+  // caller's. the number of tokens saved, -1 on error
+  int save_slot(int slot_id, const std::string &path) {
+    if (slot_id < 0 || slot_id >= n_seq) return -1;
+    slots.acquire_id(slot_id);
+    int n_token = slots.tokens(slot_id).size();
+    std::vector<uint8_t> data = run([&]() { return snapshot(slot_id); });
+    slots.release(slot_id);
+
+    if (data.empty() || !write_state_file(path, data)) {
+      AVLLM_LOG_WARN("%s: failed to save slot %d to %s\n", __func__, slot_id,
+                     path.c_str());
+      return -1;
+    }
+    AVLLM_LOG_INFO("%s: slot %d saved, %d tokens, %zu bytes\n", __func__,
+                   slot_id, n_token, data.size());
+    return n_token;
+  }
+
+  // replace the KV and the tokens of the slot with the file once the slot
+  // is free. the file is read on the caller's thread. the number of tokens
+  // restored, -1 on error
+  int restore_slot(int slot_id, const std::string &path) {
+    if (slot_id < 0 || slot_id >= n_seq) return -1;
+    std::vector<uint8_t> data = read_state_file(path);
+    slots.acquire_id(slot_id);
+    int n = run([&]() {
+      forget_session(slot_id);
+      return load_snapshot(slot_id, data);
+    });
+    slots.release(slot_id);
+    if (n < 0)
+      AVLLM_LOG_WARN("%s: failed to restore slot %d from %s\n", __func__,
+                     slot_id, path.c_str());
+    else
+      AVLLM_LOG_INFO("%s: slot %d restored, %d tokens, %zu bytes\n",
+                     __func__, slot_id, n, data.size());
+    return n;
+  }
+
+  int get_n_seq() const { return n_seq; }
+  int get_n_ctx_seq() const { return n_ctx_seq; }
+  grammar_cache &get_grammars() { return grammars; }
+
+  // acquire a slot for the prompt, submit it and block until the generation
+  // ends. func_ is called from the scheduler thread with the same contract
+  // as context_gen_text_until_eog: (0, piece) per token, (-1, "") at the
+  // end, a negative return stops the generation.
+  int generate(std::vector<llama_token> &prompt_tokens,
+               std::function<int(int, const std::string &)> func_,
+               const gen_params &params = {}, gen_stats *stats = nullptr) {
+    return generate_n(
+        prompt_tokens, 1,
+        [&func_](int, int rc, const std::string &text) {
+          return func_(rc, text);
+        },
+        params, stats);
+  }
+
+  // parallel sampling: n completions of one prompt. the prompt is decoded
+  // once on the first slot, the n-1 others copy its KV and all of them
+  // decode in the same batches. func_ gets the index of the completion
+  // first, stats (if set) points to n entries. n must not exceed n_seq
+  int generate_n(std::vector<llama_token> &prompt_tokens, int n,
+                 std::function<int(int, int, const std::string &)> func_,
+                 const gen_params &params = {}, gen_stats *stats = nullptr) {
+    n = std::clamp(n, 1, n_seq);
+    bool is_session_hit = false;
+    std::vector<int> slot_ids =
+        slots.acquire_n(prompt_tokens, params.session_id, n, &is_session_hit);
+
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+    std::vector<std::shared_ptr<gen_sequence>> seqs;
+    for (int i = 0; i < n; i++) {
+      // the branches of a seeded request get distinct seeds
+      sampling_params sampling = params.sampling;
+      if (sampling.seed != LLAMA_DEFAULT_SEED) sampling.seed += i;
+
+      llama_sampler *smpl_grammar = nullptr;
+      llama_sampler *smpl = slots.sampler(slot_ids[i], vocab, sampling,
+                                          &grammars, &smpl_grammar);
+      if (!smpl) {
+        AVLLM_LOG_ERROR("%s: error: could not create sampling\n", __func__);
+        for (int slot_id : slot_ids) slots.release(slot_id);
+        return -1;
+      }
+
+      auto seq = std::make_shared<gen_sequence>();
+      seq->seq_id = slot_ids[i];
+      seq->prompt_tokens = prompt_tokens;
+      seq->func_ = [&func_, i](int rc, const std::string &text) {
+        return func_(i, rc, text);
+      };
+      seq->smpl = smpl;
+      seq->smpl_grammar = smpl_grammar;
+      seq->detok = detokenizer(&pieces);
+      seq->stops = stop_matcher(params.stop, params.is_stop_inclusive);
+      seq->n_predict = params.n_predict;
+      seq->is_logprob = params.is_logprob;
+      seq->speculative = params.speculative;
+      seq->cancelled = params.cancelled;
+      seq->stats.slot_id = slot_ids[i];
+      if (i == 0) {
+        seq->append = params.append && is_session_hit;
+        seq->is_append_requested = params.append;
+        seq->session_id = params.session_id;
+        // a session away from its slot comes back from its file, read here
+        // rather than on the scheduler thread
+        if (files && !is_session_hit && !params.session_id.empty())
+          seq->session_state = files->read(session_path(params.session_id));
+      } else {
+        seq->parent = seqs[0].get();
+        seqs[0]->forks.push_back(seq.get());
+      }
+      seqs.push_back(seq);
+    }
+
+    int rc = -1;
+    {
+      std::unique_lock lk(mt);
+      if (!stopped) {
+        pending.insert(pending.end(), seqs.begin(), seqs.end());
+        cv.notify_all();
+        cv_done.wait(lk, [&seqs]() {
+          return std::all_of(
+              seqs.begin(), seqs.end(),
+              [](const std::shared_ptr<gen_sequence> &seq) {
+                return seq->done;
+              });
+        });
+        rc = seqs[0]->rc;
+        if (stats)
+          for (int i = 0; i < n; i++) stats[i] = seqs[i]->stats;
+      }
+    }
+
+    for (int slot_id : slot_ids) slots.release(slot_id);
+    return rc;
+  }
+
+ private:
+  void loop() {
+    std::vector<std::function<void()>> tasks_now;
+    std::vector<std::shared_ptr<gen_sequence>> admitted;
+    while (true) {
+      {
+        std::unique_lock lk(mt);
+        cv.wait(lk, [this]() {
+          return stopped || !pending.empty() || !active.empty() ||
+                 !tasks.empty();
+        });
+        if (stopped) break;
+        tasks_now.swap(tasks);
+        admitted.swap(pending);
+      }
+
+      // out of mt: the tasks and the admissions may copy whole KV states,
+      // the callers keep submitting meanwhile
+      for (auto &task : tasks_now) task();
+      tasks_now.clear();
+      for (auto &seq : admitted) admit(seq);
+      admitted.clear();
+      step();
+    }
+
+    // the resident sessions are saved for the next run
+    for (int i = 0; i < (int)kv_sessions.size(); i++) evict(i);
+
+    // release the waiting callers, the later tasks run on their thread
+    std::lock_guard lk(mt);
+    for (auto &task : tasks) task();
+    tasks.clear();
+    is_loop_done = true;
+    for (auto &seq : pending) active.push_back(seq);
+    pending.clear();
+    for (auto &seq : active) {
+      seq->rc = -1;
+      seq->done = true;
+    }
+    active.clear();
+    cv_done.notify_all();
+  }
+
+  // run f on the scheduler thread, between two steps, and wait for it
+  template <typename F>
+  auto run(F f) -> decltype(f()) {
+    std::packaged_task<decltype(f())()> task(std::move(f));
+    auto result = task.get_future();
+    {
+      std::lock_guard lk(mt);
+      if (is_loop_done || !th.joinable()) {
+        task();
+      } else {
+        tasks.emplace_back([&task]() { task(); });
+        cv.notify_all();
+      }
+    }
+    return result.get();
+  }
+
+  // the tokens and the KV of the slot in one buffer: a magic, the number of
+  // tokens, the tokens, then the state of the sequence. empty on error
+  std::vector<uint8_t> snapshot(int slot_id) {
+    const std::vector<llama_token> &tokens = slots.tokens(slot_id);
+    uint32_t head[2] = {snapshot_magic, (uint32_t)tokens.size()};
+    size_t n_head = sizeof(head) + tokens.size() * sizeof(llama_token);
+    size_t n_state = llama_state_seq_get_size(ctx, slot_id);
+
+    std::vector<uint8_t> data(n_head + n_state);
+    memcpy(data.data(), head, sizeof(head));
+    memcpy(data.data() + sizeof(head), tokens.data(),
+           tokens.size() * sizeof(llama_token));
+    if (llama_state_seq_get_data(ctx, data.data() + n_head, n_state,
+                                 slot_id) != n_state)
+      return {};
+    return data;
+  }
+
+  // replace the slot with a snapshot. the number of tokens, -1 on error
+  int load_snapshot(int slot_id, const std::vector<uint8_t> &data) {
+    llama_memory_t mem = llama_get_memory(ctx);
+    std::vector<llama_token> &tokens = slots.tokens(slot_id);
+    llama_memory_seq_rm(mem, slot_id, -1, -1);
+    tokens.clear();
+    unshare(slot_id, 0);
+
+    uint32_t head[2] = {0, 0};
+    if (data.size() >= sizeof(head)) memcpy(head, data.data(), sizeof(head));
+    size_t n_head = sizeof(head) + (size_t)head[1] * sizeof(llama_token);
+    if (head[0] != snapshot_magic || data.size() <= n_head ||
+        (int)head[1] > n_ctx_seq)
+      return -1;
+    if (llama_state_seq_set_data(ctx, data.data() + n_head,
+                                 data.size() - n_head, slot_id) == 0) {
+      llama_memory_seq_rm(mem, slot_id, -1, -1);
+      return -1;
+    }
+    tokens.resize(head[1]);
+    memcpy(tokens.data(), data.data() + sizeof(head),
+           tokens.size() * sizeof(llama_token));
+    return tokens.size();
+  }
+
+  std::string session_path(const std::string &session_id) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016zx.bin",
+             std::hash<std::string>{}(session_id));
+    return (session_dir / name).generic_string();
+  }
+
+  // the slot is about to be overwritten: save the session it holds. the
+  // KV is copied here, the file is written in the background
+  void evict(int slot_id) {
+    if (session_dir.empty() || kv_sessions[slot_id].empty()) return;
+    if (!slots.tokens(slot_id).empty()) {
+      std::vector<uint8_t> data = snapshot(slot_id);
+      if (!data.empty())
+        files->write(session_path(kv_sessions[slot_id]), std::move(data));
+    }
+    kv_sessions[slot_id].clear();
+  }
+
+  // the KV of the slot is dropped or taken over outside of a request: it
+  // holds no session, for the routing of the requests nor for the files
+  void forget_session(int slot_id) {
+    slots.forget_session(slot_id);
+    if (!kv_sessions.empty()) kv_sessions[slot_id].clear();
+  }
+
+  // the slot of seq holds the KV of another session (or none): save it,
+  // then restore the session of seq from the state its caller read
+  void swap_session(gen_sequence *seq) {
+    std::vector<uint8_t> state = std::move(seq->session_state);
+    if (kv_sessions[seq->seq_id] == seq->session_id) return;
+    evict(seq->seq_id);
+    if (seq->session_id.empty()) return;
+
+    if (!state.empty() && load_snapshot(seq->seq_id, state) > 0)
+      seq->append = seq->is_append_requested;
+    kv_sessions[seq->seq_id] = seq->session_id;
+  }
+
+  static bool is_cancelled(const gen_sequence &seq) {
+    return seq.cancelled && seq.cancelled->load(std::memory_order_relaxed);
+  }
+
+  void admit(std::shared_ptr<gen_sequence> seq) {
+    if (is_cancelled(*seq)) {  // gone while waiting for a slot
+      finish(seq.get(), -1);
+      return;
+    }
+
+    if (seq->parent) {  // a fork takes its prompt from the parent
+      if (seq->parent->done) {
+        seq->func_(-1, "");
+        seq->stats.finish_reason = seq->parent->stats.finish_reason;
+        finish(seq.get(), seq->parent->rc);
+        return;
+      }
+      active.push_back(seq);
+      return;
+    }
+
+    if (!session_dir.empty()) swap_session(seq.get());
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    std::vector<llama_token> &cached = slots.tokens(seq->seq_id);
+
+    if (!seq->append && overflow != ctx_overflow::error)
+      truncate_prompt(seq.get());
+
+    if (!seq->append) {
+      // prefix cache: keep the longest common prefix of what the slot holds,
+      // at least one prompt token is decoded to get the logits
+      size_t n_keep = slot_manager::common_prefix(cached, seq->prompt_tokens);
+      if (host_cache) n_keep = host_swap(seq.get(), n_keep);
+      if (n_keep == seq->prompt_tokens.size() && n_keep > 0) n_keep--;
+
+      if (!llama_memory_seq_rm(mem, seq->seq_id, n_keep, -1)) {
+        llama_memory_seq_rm(mem, seq->seq_id, -1, -1);
+        n_keep = 0;
+      }
+      unshare(seq->seq_id, n_keep);
+      AVLLM_LOG_DEBUG("%s: seq %d reuses %zu of %zu prompt tokens\n", __func__,
+                      seq->seq_id, n_keep, seq->prompt_tokens.size());
+      cached.resize(n_keep);
+      seq->n_prompt_done = n_keep;
+      seq->stats.n_prompt_cached = n_keep;
+    }
+    seq->n_past = llama_memory_seq_pos_max(mem, seq->seq_id) + 1;
+
+    int n_left = seq->prompt_tokens.size() - seq->n_prompt_done;
+    if (overflow == ctx_overflow::shift)
+      while (seq->n_past + n_left > n_ctx_seq)
+        if (!shift(seq.get())) break;
+    if (seq->n_past + n_left > n_ctx_seq) {
+      AVLLM_LOG_WARN("%s: the context is exceeded. \n", __func__);
+      seq->func_(-1, "");
+      seq->stats.finish_reason = "length";
+      finish(seq.get(), -1);
+      return;
+    }
+    active.push_back(seq);
+  }
+
+  // the whole blocks of the slot beyond n_keep are about to be overwritten:
+  // copy their KV to the host cache
+  void stash(int slot_id, size_t n_keep) {
+    std::vector<llama_token> &cached = slots.tokens(slot_id);
+    size_t n_block = host_cache->block_size();
+    size_t n_stash = cached.size() / n_block * n_block;
+    if (n_stash <= n_keep || host_cache->contains(cached, n_stash)) return;
+
+    llama_memory_seq_rm(llama_get_memory(ctx), slot_id, n_stash, -1);
+    cached.resize(n_stash);
+    unshare(slot_id, n_stash);
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot_id));
+    if (llama_state_seq_get_data(ctx, state.data(), state.size(), slot_id) !=
+        state.size())
+      return;
+    host_cache->put(cached, std::move(state));
+    AVLLM_LOG_DEBUG("%s: slot %d, %zu tokens, %zu bytes cached in total\n",
+                    __func__, slot_id, n_stash, host_cache->size_bytes());
+  }
+
+  // the slot of seq reuses n_keep prompt tokens. when the host cache holds
+  // a longer prefix of the prompt, the slot is stashed and the prefix copied
+  // in. the number of prompt tokens the slot holds
+  size_t host_swap(gen_sequence *seq, size_t n_keep) {
+    stash(seq->seq_id, n_keep);
+
+    const std::vector<llama_token> &prompt = seq->prompt_tokens;
+    if (prompt.empty()) return n_keep;
+    auto [n_host, state] = host_cache->find(prompt, prompt.size() - 1);
+    if (n_host <= n_keep) return n_keep;
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    std::vector<llama_token> &cached = slots.tokens(seq->seq_id);
+    llama_memory_seq_rm(mem, seq->seq_id, -1, -1);
+    cached.clear();
+    unshare(seq->seq_id, 0);
+    if (llama_state_seq_set_data(ctx, state->data(), state->size(),
+                                 seq->seq_id) == 0) {
+      llama_memory_seq_rm(mem, seq->seq_id, -1, -1);
+      return 0;
+    }
+    llama_memory_seq_rm(mem, seq->seq_id, n_host, -1);  // more blocks
+    cached.assign(prompt.begin(), prompt.begin() + n_host);
+    AVLLM_LOG_DEBUG("%s: seq %d, %zu prompt tokens from the host cache\n",
+                    __func__, seq->seq_id, n_host);
+    return n_host;
+  }
+
+  // a prompt which doesn't fit in the context of a slot is cut in the
+  // middle, see truncate_prompt_tokens
+  void truncate_prompt(gen_sequence *seq) {
+    int n_erase = truncate_prompt_tokens(seq->prompt_tokens, n_ctx_seq, n_keep,
+                                         ctx_discard);
+    if (n_erase == 0) return;
+    AVLLM_LOG_INFO("%s: seq %d prompt truncated by %d tokens\n", __func__,
+                   seq->seq_id, n_erase);
+  }
+
+  // make room in the context of the sequence: discard ctx_discard of the
+  // tokens after the first n_keep. false when nothing can be discarded
+  bool shift(gen_sequence *seq) {
+    std::vector<llama_token> &tokens = slots.tokens(seq->seq_id);
+    int n_past = std::min<int>(seq->n_past, tokens.size());
+    int n_keep_seq = std::min(n_keep, n_past);
+    int n_discard = (n_past - n_keep_seq) * ctx_discard;
+    if (n_discard <= 0 || !context_shift(llama_get_memory(ctx), seq->seq_id,
+                                         n_keep_seq, n_discard))
+      return false;
+
+    tokens.erase(tokens.begin() + n_keep_seq,
+                 tokens.begin() + n_keep_seq + n_discard);
+    unshare(seq->seq_id, n_keep_seq);
+    seq->n_past -= n_discard;
+    AVLLM_LOG_INFO("%s: seq %d discards %d tokens\n", __func__, seq->seq_id,
+                   n_discard);
+    return true;
+  }
+
+  void finish(gen_sequence *seq, int rc) {
+    std::lock_guard lk(mt);
+    seq->rc = rc;
+    seq->done = true;
+    cv_done.notify_all();
+  }
+
+  // draft up to n_draft_max tokens following the last token of each
+  // sequence with the draft model. the sequences share the draft decodes:
+  // one batch catches them up, then one decode per drafted position. the
+  // draft KV of a sequence is synced with the target one by prefix, like
+  // the prefix cache
+  void draft(const std::vector<gen_sequence *> &seqs) {
+    struct drafting {
+      gen_sequence *seq;
+      std::vector<llama_token> target;
+      int n_draft;
+      int i_batch;
+    };
+
+    llama_memory_t mem_dft = llama_get_memory(ctx_dft);
+    std::vector<drafting> todo;
+    for (gen_sequence *seq : seqs) {
+      int n_draft = std::min(n_draft_max, n_ctx_seq - (int)seq->n_past - 1);
+      if (n_draft <= 0) continue;
+
+      std::vector<llama_token> &dft = dft_tokens[seq->seq_id];
+      std::vector<llama_token> target = slots.tokens(seq->seq_id);
+      target.push_back(seq->last_token);
+
+      size_t n_keep = slot_manager::common_prefix(dft, target);
+      if (n_keep == target.size()) n_keep--;
+      if (!llama_memory_seq_rm(mem_dft, seq->seq_id, n_keep, -1)) {
+        llama_memory_seq_rm(mem_dft, seq->seq_id, -1, -1);
+        n_keep = 0;
+      }
+      dft.resize(n_keep);
+      todo.push_back({seq, std::move(target), n_draft, -1});
+    }
+
+    // a failed draft decode leaves the draft KV unknown: drop it
+    auto decode = [&]() {
+      if (batch_dft.n_tokens == 0 || !llama_decode(ctx_dft, batch_dft))
+        return true;
+      for (drafting &d : todo) {
+        llama_memory_seq_rm(mem_dft, d.seq->seq_id, -1, -1);
+        dft_tokens[d.seq->seq_id].clear();
+      }
+      return false;
+    };
+
+    // catch up with the targets: all but the last token of each sequence
+    // in full batches, then the last tokens together for the logits
+    common_batch_clear(batch_dft);
+    for (drafting &d : todo) {
+      std::vector<llama_token> &dft = dft_tokens[d.seq->seq_id];
+      for (size_t i = dft.size(); i + 1 < d.target.size(); i++) {
+        if (batch_dft.n_tokens == n_batch) {
+          if (!decode()) return;
+          common_batch_clear(batch_dft);
+        }
+        common_batch_add(batch_dft, d.target[i], i, {d.seq->seq_id}, false);
+        dft.push_back(d.target[i]);
+      }
+    }
+    if (batch_dft.n_tokens + (int)todo.size() > n_batch) {
+      if (!decode()) return;
+      common_batch_clear(batch_dft);
+    }
+    for (drafting &d : todo) {
+      d.i_batch = batch_dft.n_tokens;
+      common_batch_add(batch_dft, d.target.back(), d.target.size() - 1,
+                       {d.seq->seq_id}, true);
+      dft_tokens[d.seq->seq_id].push_back(d.target.back());
+    }
+
+    // draft greedily, one position of all the sequences per decode
+    while (true) {
+      if (!decode()) break;
+      std::vector<int> idx;
+      for (drafting &d : todo) idx.push_back(d.i_batch);
+
+      common_batch_clear(batch_dft);
+      for (size_t k = 0; k < todo.size(); k++) {
+        drafting &d = todo[k];
+        if (idx[k] < 0) continue;
+        llama_token token =
+            llama_sampler_sample(smpl_dft.get(), ctx_dft, idx[k]);
+        d.seq->drafts.push_back(token);
+        d.i_batch = -1;
+        if ((int)d.seq->drafts.size() >= d.n_draft) continue;
+
+        std::vector<llama_token> &dft = dft_tokens[d.seq->seq_id];
+        d.i_batch = batch_dft.n_tokens;
+        common_batch_add(batch_dft, token, dft.size(), {d.seq->seq_id}, true);
+        dft.push_back(token);
+      }
+      if (batch_dft.n_tokens == 0) break;
+    }
+  }
+
+  // prompt lookup: find the latest earlier occurrence of the last n tokens
+  // (n from ngram_max down to ngram_min) in the prompt and the output, and
+  // propose the tokens that followed it
+  std::vector<llama_token> draft_ngram(gen_sequence *seq) {
+    static constexpr int ngram_max = 4;
+    static constexpr int ngram_min = 1;
+
+    std::vector<llama_token> result;
+    int n_draft = std::min(n_draft_max, n_ctx_seq - (int)seq->n_past - 1);
+    if (n_draft <= 0) return result;
+
+    const std::vector<llama_token> &hist = slots.tokens(seq->seq_id);
+    const int n_hist = hist.size() + 1;  // plus the last token
+    auto at = [&](int i) {
+      return i + 1 == n_hist ? seq->last_token : hist[i];
+    };
+
+    for (int n = std::min(ngram_max, n_hist - 1); n >= ngram_min; n--) {
+      for (int i = n_hist - n - 1; i >= 0; i--) {
+        int k = 0;
+        while (k < n && at(i + k) == at(n_hist - n + k)) k++;
+        if (k < n) continue;
+
+        for (int j = i + n; j < n_hist && (int)result.size() < n_draft; j++)
+          result.push_back(at(j));
+        return result;
+      }
+    }
+    return result;
+  }
+
+  // the prompt of seq is decoded: its forks copy the KV and take their first
+  // token from the same logits
+  void fork(gen_sequence *seq) {
+    llama_memory_t mem = llama_get_memory(ctx);
+    for (gen_sequence *f : seq->forks) {
+      f->parent = nullptr;
+      if (f->done) continue;
+
+      evict(f->seq_id);
+      forget_session(f->seq_id);
+      if (host_cache) stash(f->seq_id, 0);
+      llama_memory_seq_rm(mem, f->seq_id, -1, -1);
+      unshare(f->seq_id, 0);
+      llama_memory_seq_cp(mem, seq->seq_id, f->seq_id, -1, -1);
+      slots.tokens(f->seq_id) = slots.tokens(seq->seq_id);
+      kv_parent[f->seq_id] = seq->seq_id;
+      n_kv_shared[f->seq_id] = slots.tokens(seq->seq_id).size();
+      f->prompt_tokens = seq->prompt_tokens;  // as truncated
+      f->n_prompt_done = f->prompt_tokens.size();
+      f->n_past = seq->n_past;
+      f->i_batch = seq->i_batch;
+      f->stats.n_prompt_cached = f->prompt_tokens.size();
+    }
+    seq->forks.clear();
+  }
+
+  // log probability of the token under the logits of the batch entry
+  float token_logprob(int idx, llama_token token) const {
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const float *logits = llama_get_logits_ith(ctx, idx);
+
+    float max = *std::max_element(logits, logits + n_vocab);
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; i++) sum += std::exp(logits[i] - max);
+    return logits[token] - max - (float)std::log(sum);
+  }
+
+  // hand a sampled token to the caller. return false when the sequence ends
+  bool emit(gen_sequence *seq, llama_token new_token) {
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    if (llama_vocab_is_eog(vocab, new_token)) {
+      end(seq, "stop", 0);
+      return false;
+    }
+
+    if (seq->n_past + 1 > n_ctx_seq &&
+        !(overflow == ctx_overflow::shift && shift(seq))) {
+      AVLLM_LOG_WARN("%s: the context is exceeded. \n", __func__);
+      end(seq, "length", -1);
+      return false;
+    }
+
+    // the text may be empty while a UTF-8 character or a possible stop
+    // string is incomplete, the caller still sees one call per token
+    bool is_stop = false;
+    const std::string *text = &seq->detok.push(new_token);
+    if (!seq->stops.empty()) text = &seq->stops.push(*text, &is_stop);
+    seq->stats.n_predicted++;
+
+    if (seq->func_(0, *text) < 0) {
+      AVLLM_LOG_WARN("%s, terminated by caller \n", __func__);
+      seq->stats.finish_reason = "stop";
+      finish(seq, 0);
+      return false;
+    }
+
+    if (is_stop) {
+      seq->func_(-1, "");
+      seq->stats.finish_reason = "stop";
+      finish(seq, 0);
+      return false;
+    }
+
+    if (seq->n_predict > 0 && seq->stats.n_predicted >= seq->n_predict) {
+      end(seq, "length", 0);
+      return false;
+    }
+
+    seq->last_token = new_token;
+    return true;
+  }
+
+  // end the sequence: hand the held back text to the caller, then the end
+  // of generation
+  void end(gen_sequence *seq, const char *finish_reason, int rc) {
+    bool is_stop = false;
+    const std::string *rest = &seq->detok.flush();
+    if (!seq->stops.empty()) {
+      std::string text = seq->stops.push(*rest, &is_stop);
+      if (!is_stop) text += seq->stops.flush();
+      if (!text.empty()) seq->func_(0, text);
+    } else if (!rest->empty()) {
+      seq->func_(0, *rest);
+    }
+
+    seq->func_(-1, "");
+    seq->stats.finish_reason = is_stop ? "stop" : finish_reason;
+    finish(seq, rc);
+  }
+
+  // the KV of the slot from position n on is gone: the cells past n are
+  // no longer shared with the slot it was forked from, nor with its forks
+  void unshare(int slot_id, size_t n) {
+    for (int i = 0; i < n_seq; i++) {
+      if (i != slot_id && kv_parent[i] != slot_id) continue;
+      n_kv_shared[i] = std::min(n_kv_shared[i], n);
+      if (n_kv_shared[i] == 0) kv_parent[i] = -1;
+    }
+  }
+
+  // the cells held by the slots. the prefix a fork shares with its parent
+  // is counted once, with the parent
+  int n_cells_used() {
+    int n = 0;
+    for (int i = 0; i < n_seq; i++) {
+      size_t n_tokens = slots.tokens(i).size();
+      n += n_tokens - std::min(n_kv_shared[i], n_tokens);
+    }
+    return n;
+  }
+
+  // drop the KV of the least recently used idle slot. false when all the
+  // slots are busy
+  bool drop_idle() {
+    int slot_id = slots.acquire_idle();
+    if (slot_id < 0) return false;
+
+    evict(slot_id);
+    forget_session(slot_id);
+    if (host_cache) stash(slot_id, 0);
+    llama_memory_seq_rm(llama_get_memory(ctx), slot_id, -1, -1);
+    slots.tokens(slot_id).clear();
+    unshare(slot_id, 0);
+    if (ctx_dft) {
+      llama_memory_seq_rm(llama_get_memory(ctx_dft), slot_id, -1, -1);
+      dft_tokens[slot_id].clear();
+    }
+    slots.release(slot_id, false);
+    AVLLM_LOG_DEBUG("%s: slot %d dropped\n", __func__, slot_id);
+    return true;
+  }
+
+  // unified KV: make room for n cells by dropping the KV of idle slots,
+  // least recently used first. the number of free cells
+  int reclaim(int n) {
+    int n_free = n_cells - n_cells_used();
+    while (n_free < n && drop_idle()) n_free = n_cells - n_cells_used();
+    return std::max(0, n_free);
+  }
+
+  // the latest sequence holding cells, nullptr when none
+  gen_sequence *newest() {
+    for (auto it = active.rbegin(); it != active.rend(); ++it)
+      if (!(*it)->done && !(*it)->parent) return it->get();
+    return nullptr;
+  }
+
+  // the KV is full: the sequence stops, its slot frees its cells once the
+  // caller releases it
+  void kv_full(gen_sequence *seq) {
+    AVLLM_LOG_WARN("%s: seq %d stopped, the KV is full\n", __func__,
+                   seq->seq_id);
+    end(seq, "length", 0);
+  }
+
+  // unified KV: drop idle slots until the step has its cells, one per
+  // running sequence plus its drafts and the prefill chunk. when even that
+  // leaves no room for the running sequences (or none for the prefill),
+  // the latest sequence stops. the number of free cells
+  int reserve() {
+    int n_run = 0;
+    int n_need = 0;
+    size_t n_prefill = 0;
+    for (auto &seq : active) {
+      if (seq->done || seq->parent) continue;
+      size_t n_left = seq->prompt_tokens.size() - seq->n_prompt_done;
+      if (n_left > 0) {
+        n_prefill += n_left;
+        continue;
+      }
+      n_run++;
+      n_need += 1 + seq->drafts.size();
+    }
+    n_need += std::min<size_t>(n_prefill, std::max(0, n_batch - n_need));
+
+    int n_free = reclaim(n_need);
+    if (n_free < n_run || (n_free == 0 && n_prefill > 0))
+      if (gen_sequence *seq = newest()) kv_full(seq);
+    return n_free;
+  }
+
+  void step() {
+    // drop the sequences whose client is gone, their slot is released at
+    // once. the KV keeps what was decoded, it is reusable as a prefix
+    for (auto &seq : active)
+      if (is_cancelled(*seq)) {
+        AVLLM_LOG_INFO("%s: seq %d cancelled\n", __func__, seq->seq_id);
+        finish(seq.get(), -1);
+      } else if (seq->parent && seq->parent->done) {  // nothing to fork
+        seq->func_(-1, "");
+        seq->stats.finish_reason = seq->parent->stats.finish_reason;
+        finish(seq.get(), seq->parent->rc);
+      }
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [](const std::shared_ptr<gen_sequence> &seq) {
+                                  return seq->done;
+                                }),
+                 active.end());
+
+    common_batch_clear(batch);
+    int n_budget = n_batch;
+
+    // the drafts of the draft model, for all the sequences at once
+    std::vector<gen_sequence *> drafted;
+    for (auto &seq : active) {
+      seq->drafts.clear();
+      seq->i_batch = -1;
+      if (seq->n_prompt_done < seq->prompt_tokens.size() || seq->parent)
+        continue;
+      if (seq->speculative == spec_mode::ngram)
+        seq->drafts = draft_ngram(seq.get());
+      else if (ctx_dft && seq->speculative == spec_mode::standard)
+        drafted.push_back(seq.get());
+    }
+    if (!drafted.empty()) draft(drafted);
+
+    int n_free = std::numeric_limits<int>::max();
+    if (n_cells > 0) n_free = reserve();
+
+    // what the batch adds to the sequences, undone when it doesn't fit
+    struct undo {
+      gen_sequence *seq;
+      llama_pos n_past;
+      size_t n_prompt_done;
+      size_t n_tokens;
+    };
+    std::vector<undo> undos;
+    for (auto &seq : active)
+      undos.push_back({seq.get(), seq->n_past, seq->n_prompt_done,
+                       slots.tokens(seq->seq_id).size()});
+
+    // running sequences first: the last token (plus the drafted ones to
+    // verify), so streams keep their pace
+    for (auto &seq : active) {
+      if (seq->done || seq->n_prompt_done < seq->prompt_tokens.size())
+        continue;
+      if (n_free <= 0 || n_budget <= 0) break;  // waits for the next step
+
+      if ((int)seq->drafts.size() + 1 > std::min(n_budget, n_free))
+        seq->drafts.clear();
+
+      seq->i_batch = batch.n_tokens;
+      common_batch_add(batch, seq->last_token, seq->n_past, {seq->seq_id},
+                       true);
+      for (size_t i = 0; i < seq->drafts.size(); i++)
+        common_batch_add(batch, seq->drafts[i], seq->n_past + 1 + i,
+                         {seq->seq_id}, true);
+      seq->n_past++;
+      slots.tokens(seq->seq_id).push_back(seq->last_token);
+      n_budget -= 1 + seq->drafts.size();
+      n_free -= 1 + seq->drafts.size();
+    }
+
+    // prefill the newcomers with the rest of the batch
+    for (auto &seq : active) {
+      size_t n_left = seq->prompt_tokens.size() - seq->n_prompt_done;
+      if (n_left == 0 || n_budget <= 0 || n_free <= 0 || seq->parent ||
+          seq->done)
+        continue;
+
+      size_t n_take = std::min<size_t>(n_left, std::min(n_budget, n_free));
+      for (size_t i = 0; i < n_take; i++) {
+        bool is_last = seq->n_prompt_done + 1 == seq->prompt_tokens.size();
+        llama_token token = seq->prompt_tokens[seq->n_prompt_done++];
+        common_batch_add(batch, token, seq->n_past++, {seq->seq_id}, is_last);
+        slots.tokens(seq->seq_id).push_back(token);
+      }
+      if (seq->n_prompt_done == seq->prompt_tokens.size())
+        seq->i_batch = batch.n_tokens - 1;
+      n_budget -= n_take;
+      n_free -= n_take;
+    }
+
+    if (batch.n_tokens == 0) return;
+
+    if (int rc = llama_decode(ctx, batch); rc == 1) {
+      // no room in the KV for the batch, nothing was decoded. an idle slot
+      // or the latest sequence gives up its cells, the step is retried
+      AVLLM_LOG_WARN("%s: no KV slot for %d tokens\n", __func__,
+                     batch.n_tokens);
+      for (const undo &u : undos) {
+        u.seq->n_past = u.n_past;
+        u.seq->n_prompt_done = u.n_prompt_done;
+        u.seq->i_batch = -1;
+        u.seq->drafts.clear();
+        slots.tokens(u.seq->seq_id).resize(u.n_tokens);
+      }
+      if (n_cells == 0 || !drop_idle())
+        if (gen_sequence *seq = newest()) kv_full(seq);
+      return;
+    } else if (rc) {
+      AVLLM_LOG_ERROR("%s : failed to eval, return code %d\n", __func__, rc);
+      for (auto &seq : active) {
+        if (seq->done) continue;
+        // the KV of the sequence is unknown, drop it
+        llama_memory_seq_rm(llama_get_memory(ctx), seq->seq_id, -1, -1);
+        slots.tokens(seq->seq_id).clear();
+        unshare(seq->seq_id, 0);
+        forget_session(seq->seq_id);
+        seq->func_(-1, "");
+        finish(seq.get(), -1);
+      }
+      active.clear();
+      return;
+    }
+
+    for (auto &seq : active)
+      if (!seq->forks.empty() && seq->i_batch >= 0) fork(seq.get());
+
+    for (auto &seq : active) {
+      if (seq->i_batch < 0) continue;
+
+      // verify the drafts: accept while the target samples the same token,
+      // the first mismatch is the correction
+      // the stats are counted before emit, which may end the sequence and
+      // hand them to the caller
+      seq->stats.n_draft += seq->drafts.size();
+      for (size_t i = 0; i <= seq->drafts.size(); i++) {
+        llama_token new_token = sampler_sample(seq->smpl, seq->smpl_grammar,
+                                               ctx, seq->i_batch + i);
+        if (seq->is_logprob)
+          seq->stats.logprob += token_logprob(seq->i_batch + i, new_token);
+        bool is_accepted =
+            i < seq->drafts.size() && new_token == seq->drafts[i];
+        if (is_accepted) seq->stats.n_draft_accepted++;
+        if (!emit(seq.get(), new_token)) break;
+        if (!is_accepted) break;
+
+        seq->n_past++;
+        slots.tokens(seq->seq_id).push_back(new_token);
+      }
+
+      if (!seq->drafts.empty())
+        llama_memory_seq_rm(llama_get_memory(ctx), seq->seq_id, seq->n_past,
+                            -1);
+    }
+
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [](const std::shared_ptr<gen_sequence> &seq) {
+                                  return seq->done;
+                                }),
+                 active.end());
+  }
+
+  llama_context *ctx;
+  int n_seq;
+  int n_batch;
+  int n_ctx_seq;
+  int n_cells = 0;  // of the unified KV, 0: n_ctx_seq cells per slot
+  // the slot each slot was forked from and the number of cells they still
+  // share, the first ones
+  std::vector<int> kv_parent;
+  std::vector<size_t> n_kv_shared;
+  llama_batch batch;
+  slot_manager slots;
+  grammar_cache grammars;
+  piece_table pieces;  // of the model of ctx
+  ctx_overflow overflow = ctx_overflow::error;
+  int n_keep = 0;
+  float ctx_discard = 0.5f;
+
+  // speculative decoding (scheduler thread)
+  llama_context *ctx_dft = nullptr;
+  int n_draft_max = 0;
+  llama_batch batch_dft;
+  llama_sampler_ptr smpl_dft;
+  std::vector<std::vector<llama_token>> dft_tokens;
+
+  // persistent sessions (scheduler thread): the session each slot holds
+  std::filesystem::path session_dir;
+  std::vector<std::string> kv_sessions;
+  std::unique_ptr<state_files> files;
+  static constexpr uint32_t snapshot_magic = 0x564b5641;  // "AVKV"
+
+  std::unique_ptr<kv_host_cache> host_cache;  // scheduler thread
+
+  std::vector<std::function<void()>> tasks;            // guarded by mt
+  std::vector<std::shared_ptr<gen_sequence>> pending;  // guarded by mt
+  std::vector<std::shared_ptr<gen_sequence>> active;   // scheduler thread
+  bool stopped = false;
+  bool is_loop_done = false;
+  std::mutex mt;
+  std::condition_variable cv;
+  std::condition_variable cv_done;
+  std::thread th;
+};
+
+}  // namespace av_llm
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef _AVLLM_STATE_FILES_H_
+#define _AVLLM_STATE_FILES_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace av_llm {
+
+// the file is written aside then renamed, a reader never sees half of it
+inline bool write_state_file(const std::string &path,
+                             const std::vector<uint8_t> &data) {
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    f.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!f) return false;
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// empty when the file can't be read
+inline std::vector<uint8_t> read_state_file(const std::string &path) {
+  std::ifstream f(path, std::ios::binary | std::ios::ate);
+  if (!f) return {};
+  std::vector<uint8_t> data(f.tellg());
+  f.seekg(0);
+  f.read(reinterpret_cast<char *>(data.data()), data.size());
+  if (!f) return {};
+  return data;
+}
+
+// KV snapshots written to disk by a background thread: write() queues the
+// bytes and returns at once, read() gets the queued bytes of a path before
+// they reach the disk. what is queued is written before the destructor
+// returns
+class state_files {
+ public:
+  state_files() : th(&state_files::run, this) {}
+
+  ~state_files() {
+    {
+      std::lock_guard lk(mt);
+      stopped = true;
+      cv.notify_all();
+    }
+    th.join();
+  }
+
+  void write(const std::string &path, std::vector<uint8_t> data) {
+    auto shared =
+        std::make_shared<const std::vector<uint8_t>>(std::move(data));
+    std::lock_guard lk(mt);
+    queued[path] = shared;
+    jobs.emplace_back(path, shared);
+    cv.notify_all();
+  }
+
+  std::vector<uint8_t> read(const std::string &path) {
+    {
+      std::lock_guard lk(mt);
+      auto it = queued.find(path);
+      if (it != queued.end()) return *it->second;
+    }
+    return read_state_file(path);
+  }
+
+ private:
+  using bytes = std::shared_ptr<const std::vector<uint8_t>>;
+  using job = std::pair<std::string, bytes>;
+
+  void run() {
+    std::unique_lock lk(mt);
+    while (true) {
+      cv.wait(lk, [this]() { return stopped || !jobs.empty(); });
+      if (jobs.empty()) return;  // stopped
+
+      job j = std::move(jobs.front());
+      jobs.pop_front();
+      lk.unlock();
+      write_state_file(j.first, *j.second);
+      lk.lock();
+
+      // a later snapshot of the path may be queued
+      auto it = queued.find(j.first);
+      if (it != queued.end() && it->second == j.second) queued.erase(it);
+    }
+  }
+
+  std::deque<job> jobs;  // guarded by mt
+  // guarded by mt, the latest snapshot of each path
+  std::unordered_map<std::string, bytes> queued;
+  bool stopped = false;
+  std::mutex mt;
+  std::condition_variable cv;
+  std::thread th;
+};
+
+}  // namespace av_llm
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _AVLLM_STOP_MATCHER_H_
+#define _AVLLM_STOP_MATCHER_H_
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace av_llm {
+
+// finds stop strings in a stream of text pieces. a stop string may span
+// pieces: the tail of the text that could be the start of a stop string is
+// held back until it is decided
+class stop_matcher {
+ public:
+  explicit stop_matcher(std::vector<std::string> stops_ = {},
+                        bool is_inclusive_ = false)
+      : is_inclusive(is_inclusive_) {
+    for (auto &stop : stops_)
+      if (!stop.empty()) stops.push_back(std::move(stop));
+  }
+
+  bool empty() const { return stops.empty(); }
+
+  // the text of the piece that can be emitted, valid until the next call.
+  // is_found is set when a stop string completes, the text then ends
+  // before the stop string (or after it, when inclusive)
+  const std::string &push(std::string_view text, bool *is_found) {
+    *is_found = false;
+    pending.append(text);
+
+    size_t pos = std::string::npos;
+    size_t len = 0;
+    for (const auto &stop : stops) {
+      size_t p = pending.find(stop);
+      if (p < pos) {
+        pos = p;
+        len = stop.size();
+      }
+    }
+
+    if (pos != std::string::npos) {
+      *is_found = true;
+      out.assign(pending, 0, is_inclusive ? pos + len : pos);
+      pending.clear();
+      return out;
+    }
+
+    size_t n_hold = 0;
+    for (const auto &stop : stops)
+      n_hold = std::max(n_hold, partial_len(pending, stop));
+    out.assign(pending, 0, pending.size() - n_hold);
+    pending.erase(0, pending.size() - n_hold);
+    return out;
+  }
+
+  // the text held back at the end of the stream
+  const std::string &flush() {
+    out.swap(pending);
+    pending.clear();
+    return out;
+  }
+
+ private:
+  // the length of the longest suffix of text which is a proper prefix of
+  // stop
+  static size_t partial_len(std::string_view text, std::string_view stop) {
+    size_t n = std::min(text.size(), stop.size() - 1);
+    for (; n > 0; n--)
+      if (text.substr(text.size() - n) == stop.substr(0, n)) return n;
+    return 0;
+  }
+
+  std::vector<std::string> stops;
+  bool is_inclusive;
+  std::string pending;
+  std::string out;
+};
+
+}  // namespace av_llm
+
+#endif
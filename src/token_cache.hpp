@@ -0,0 +1,95 @@
+#ifndef _AVLLM_TOKEN_CACHE_H_
+#define _AVLLM_TOKEN_CACHE_H_
+
+#include "llama.h"
+#include "lru_cache.hpp"
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace av_llm {
+
+// tokenize in one llama_tokenize call: the per-thread buffer is sized for
+// the worst case of the text (a token per byte plus the specials) and kept
+// across calls, the result is copied out at its exact size
+inline std::vector<llama_token> tokenize_text(const llama_vocab *vocab,
+                                              std::string_view text,
+                                              bool add_special,
+                                              bool parse_special) {
+  thread_local std::vector<llama_token> buf;
+  if (buf.size() < text.size() + 2) buf.resize(text.size() + 2);
+
+  int n = llama_tokenize(vocab, text.data(), text.size(), buf.data(),
+                         buf.size(), add_special, parse_special);
+  if (n < 0) {  // not expected, some vocab adds more than two specials
+    buf.resize(-n);
+    n = llama_tokenize(vocab, text.data(), text.size(), buf.data(),
+                       buf.size(), add_special, parse_special);
+  }
+  if (n < 0) return {};
+  return std::vector<llama_token>(buf.begin(), buf.begin() + n);
+}
+
+// tokens of large texts keyed by their content, least recently used first
+// out. repeated system prompts and tool definitions are tokenized once.
+// texts shorter than min_len bytes (1 KB by default, --token-cache-min-len
+// on the server) are tokenized every time: below that the lookup costs
+// about as much as the tokenization
+class token_cache {
+ public:
+  explicit token_cache(size_t capacity = 256, size_t min_len_ = 1024)
+      : min_len(min_len_), cache(capacity) {}
+
+  void set_min_len(size_t n) {
+    std::lock_guard lk(mt);
+    min_len = n;
+  }
+
+  std::vector<llama_token> tokenize(const llama_vocab *vocab,
+                                    const std::string &text, bool add_special,
+                                    bool parse_special) {
+    std::string k;
+    {
+      std::lock_guard lk(mt);
+      if (text.size() >= min_len) {
+        k = key(text, add_special, parse_special);
+        if (const auto *tokens = cache.get(k)) return *tokens;
+      }
+    }
+    std::vector<llama_token> tokens =
+        tokenize_text(vocab, text, add_special, parse_special);
+    if (k.empty() || tokens.empty()) return tokens;
+
+    std::lock_guard lk(mt);
+    cache.put(k, tokens);
+    return tokens;
+  }
+
+  // whether the tokens of text are cached
+  bool contains(const std::string &text, bool add_special,
+                bool parse_special) {
+    std::lock_guard lk(mt);
+    return cache.contains(key(text, add_special, parse_special));
+  }
+
+ private:
+  // the text behind the tokenize flags
+  static std::string key(const std::string &text, bool add_special,
+                         bool parse_special) {
+    std::string k;
+    k.reserve(text.size() + 1);
+    k += (char)('0' + (add_special ? 1 : 0) + (parse_special ? 2 : 0));
+    k += text;
+    return k;
+  }
+
+  size_t min_len;  // guarded by mt
+  lru_cache<std::string, std::vector<llama_token>> cache;  // guarded by mt
+  std::mutex mt;
+};
+
+}  // namespace av_llm
+
+#endif
@@ -4,16 +4,28 @@
 #include "common.h"
 #include "llama.h"
 #include "log.hpp"
+#include "sampling.hpp"
 
 #define JSON_ASSERT GGML_ASSERT
 #include <curl/curl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 using json = nlohmann::ordered_json;
@@ -32,9 +44,25 @@ struct xoptions {
     n_ubatch = 4096;
     ngl = 0;
     flash_attn = false;
+    cache_type_k = "f16";
+    cache_type_v = "f16";
+    ctx_overflow = "shift";
+    n_keep = 0;
+    ctx_discard = 0.5;
 
     port = 8080;
     n_parallel = 1;
+    n_parallel_emb = 1;
+    emb_batch_ms = 2;
+    n_queue_max = 64;
+    stream_flush_ms = 0;
+    stream_flush_bytes = 4096;
+    session_cache = false;
+    kv_host_cache_mb = 0;
+    kv_total = 0;
+    token_cache_min_len = 1024;
+
+    n_draft = 8;
   }
 
   int n_predict;
@@ -48,31 +76,52 @@ struct xoptions {
   int n_ubatch;
   int ngl;
   bool flash_attn;
+  std::string cache_type_k;  // KV cache types: f16, q8_0, q4_0...
+  std::string cache_type_v;
+  std::string ctx_overflow;  // shift, truncate-prompt or error
+  int n_keep;                // tokens kept at the start on overflow
+  double ctx_discard;        // fraction of the rest discarded on overflow
   // server
   int port;
   // others
   std::string model_url_or_alias;
   std::string model_path_emb;
+  std::string model_path_draft;  // speculative decoding
+  int n_draft;
   // llama-server
   std::string llama_srv_args;
-  int n_parallel;  // number of parallel requests
+  int n_parallel;           // number of parallel requests
+  int n_parallel_emb;       // number of pooled embedding contexts
+  int emb_batch_ms;         // window to coalesce embedding requests
+  int n_queue_max;          // waiting requests before busy, 0: unlimited
+  int stream_flush_ms;      // max latency of the buffered stream chunks
+  int stream_flush_bytes;   // buffered stream bytes written at once
+  bool session_cache;       // save the KV of evicted sessions to disk
+  int kv_host_cache_mb;     // host memory for evicted prefixes, 0: disabled
+  int kv_total;             // cells of a KV shared by the slots, 0: per slot
+  int token_cache_min_len;  // bytes of a prompt whose tokens are cached
+  // chat
+  std::string session_file;  // KV snapshot of the conversation
 };
 
 // oai
+static std::string oai_make_chunk_id(bool is_chat = true) {
+  return (is_chat ? "chatcmpl-" : "cmpl-") + std::to_string(std::time(0)) +
+         std::to_string(rand() % 10000);
+}
+
 static std::string oai_make_chunk(
     const std::string &model, std::string data, bool is_chat = true,
-    std::optional<std::string> finish_reason = std::nullopt) {
-  std::string random_id = "chatcmpl-" + std::to_string(std::time(0)) +
-                          std::to_string(rand() % 10000);
-
+    std::optional<std::string> finish_reason = std::nullopt,
+    const std::string &id = "", int index = 0) {
   nlohmann::json js{
-      {"id", random_id},
+      {"id", id.empty() ? oai_make_chunk_id(is_chat) : id},
       {"object", is_chat ? "chat.completion.chunk" : "text_completion"},
       {"created", std::time(0)},
       {"model", model},
       {"system_fingerprint", "fp_44709d6fcb"},
       {"choices",
-       {{{"index", 0},
+       {{{"index", index},
          is_chat ? nlohmann::json{"delta",
                                   {{"role", "assistant"}, {"content", data}}}
                  : nlohmann::json{"text", data}}}}};
@@ -88,16 +137,235 @@ static std::string oai_make_chunk(
 // oai chunk (completion)
 static std::string oai_chat_completion_chunk(
     const std::string &model_, std::string data,
-    std::optional<std::string> finish_reason = std::nullopt) {
-  return oai_make_chunk(model_, data, true, finish_reason);
+    std::optional<std::string> finish_reason = std::nullopt,
+    const std::string &id = "", int index = 0) {
+  return oai_make_chunk(model_, data, true, finish_reason, id, index);
 };
 
 static std::string oai_completion_chunk(
     const std::string &model_, std::string data,
-    std::optional<std::string> finish_reason = std::nullopt) {
-  return oai_make_chunk(model_, data, false, finish_reason);
+    std::optional<std::string> finish_reason = std::nullopt,
+    const std::string &id = "", int index = 0) {
+  return oai_make_chunk(model_, data, false, finish_reason, id, index);
+}
+
+// append s as the body of a JSON string (without the quotes)
+static void json_escape_append(std::string &out, std::string_view s) {
+  static const char hex[] = "0123456789abcdef";
+  for (char c : s) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\b': out += "\\b"; break;
+      case '\f': out += "\\f"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          out += "\\u00";
+          out += hex[(c >> 4) & 0xf];
+          out += hex[c & 0xf];
+        } else {
+          out += c;
+        }
+    }
+  }
 }
 
+// serializer of the SSE chunks of one stream that only differ by a text
+// delta. the bytes around the delta are built once per stream, a chunk only
+// escapes the delta into a buffer reused by the next chunk
+class sse_delta_serializer {
+ public:
+  sse_delta_serializer(std::string prefix_, std::string suffix_)
+      : prefix(std::move(prefix_)), suffix(std::move(suffix_)) {
+    buf.reserve(prefix.size() + suffix.size() + 64);
+  }
+
+  // the chunk of the delta, valid until the next call
+  const std::string &operator()(std::string_view delta) {
+    buf.assign(prefix);
+    json_escape_append(buf, delta);
+    buf += suffix;
+    return buf;
+  }
+
+ private:
+  std::string prefix;
+  std::string suffix;
+  std::string buf;
+};
+
+// "data: " chunks of a chat.completion.chunk / text_completion stream with
+// one stable id, the same bytes as oai_make_chunk without finish_reason
+static sse_delta_serializer oai_chunk_serializer(const std::string &model,
+                                                 const std::string &id,
+                                                 bool is_chat = true,
+                                                 int index = 0) {
+  std::string prefix = "data: {\"id\":" + json(id).dump() + ",\"object\":\"" +
+                       (is_chat ? "chat.completion.chunk" : "text_completion") +
+                       "\",\"created\":" + std::to_string(std::time(0)) +
+                       ",\"model\":" + json(model).dump() +
+                       ",\"system_fingerprint\":\"fp_44709d6fcb\","
+                       "\"choices\":[{\"index\":" +
+                       std::to_string(index) + ",";
+  prefix += is_chat ? "\"delta\":{\"role\":\"assistant\",\"content\":\""
+                    : "\"text\":\"";
+  std::string suffix = is_chat ? "\"},\"finish_reason\":null}]}\n\n"
+                               : "\",\"finish_reason\":null}]}\n\n";
+  return sse_delta_serializer(prefix, suffix);
+}
+
+// one thread calling the flushes of the buffered SSE writers at their
+// deadline, shared by all the streamed responses
+class sse_flush_timer {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  static sse_flush_timer &instance() {
+    static sse_flush_timer timer;
+    return timer;
+  }
+
+  ~sse_flush_timer() {
+    {
+      std::lock_guard lk(mt);
+      stopped = true;
+      cv.notify_all();
+    }
+    th.join();
+  }
+
+  // call f at the deadline, in place of what key scheduled before
+  void add(const void *key, clock::time_point deadline,
+           std::function<void()> f) {
+    std::lock_guard lk(mt);
+    due[key] = {deadline, std::move(f)};
+    cv.notify_all();
+  }
+
+  // cancel what key scheduled, wait for it to end if it is running
+  void remove(const void *key) {
+    std::unique_lock lk(mt);
+    due.erase(key);
+    cv.wait(lk, [this, key]() { return running != key; });
+  }
+
+ private:
+  sse_flush_timer() : th(&sse_flush_timer::run, this) {}
+
+  void run() {
+    std::unique_lock lk(mt);
+    while (!stopped) {
+      auto next = std::min_element(
+          due.begin(), due.end(), [](const auto &a, const auto &b) {
+            return a.second.first < b.second.first;
+          });
+      if (next == due.end()) {
+        cv.wait(lk);
+        continue;
+      }
+      if (clock::now() < next->second.first) {
+        cv.wait_until(lk, next->second.first);
+        continue;
+      }
+
+      std::function<void()> f = std::move(next->second.second);
+      running = next->first;
+      due.erase(next);
+      lk.unlock();
+      f();
+      lk.lock();
+      running = nullptr;
+      cv.notify_all();
+    }
+  }
+
+  // guarded by mt
+  std::unordered_map<const void *,
+                     std::pair<clock::time_point, std::function<void()>>>
+      due;
+  const void *running = nullptr;  // guarded by mt
+  bool stopped = false;
+  std::mutex mt;
+  std::condition_variable cv;
+  std::thread th;
+};
+
+// buffered writer of the SSE chunks of one response. an event line and its
+// data go out in one write; with flush_ms > 0 the chunks are held until
+// flush_bytes are buffered or flush_ms passed since the oldest one. the
+// shared sse_flush_timer flushes at that deadline, whether or not another
+// chunk comes, and flush() sends the rest at the end of stream. thread safe
+template <typename response_t>
+class sse_writer {
+ public:
+  sse_writer(std::shared_ptr<response_t> res_, int flush_ms_ = 0,
+             size_t flush_bytes_ = 4096)
+      : res(std::move(res_)), flush_ms(flush_ms_), flush_bytes(flush_bytes_) {
+    buf.reserve(flush_bytes);
+  }
+
+  ~sse_writer() {
+    if (flush_ms > 0) sse_flush_timer::instance().remove(this);
+  }
+
+  // a framed chunk ("data: ...\n\n")
+  void write(std::string_view chunk) {
+    std::lock_guard lk(mt);
+    start();
+    buf += chunk;
+    flush_if_full();
+  }
+
+  // "event: <event>\n" followed by its framed data chunk
+  void write(std::string_view event, std::string_view chunk) {
+    std::lock_guard lk(mt);
+    start();
+    buf += "event: ";
+    buf += event;
+    buf += "\n";
+    buf += chunk;
+    flush_if_full();
+  }
+
+  void flush() {
+    std::lock_guard lk(mt);
+    send();
+  }
+
+ private:
+  // the buffer gets its first chunk: the timer flushes it at the deadline.
+  // a deadline left by a buffer sent since finds nothing to send
+  void start() {
+    if (flush_ms <= 0 || !buf.empty()) return;
+    sse_flush_timer::instance().add(
+        this,
+        sse_flush_timer::clock::now() + std::chrono::milliseconds(flush_ms),
+        [this]() {
+          std::lock_guard lk(mt);
+          send();
+        });
+  }
+
+  void flush_if_full() {
+    if (flush_ms <= 0 || buf.size() >= flush_bytes) send();
+  }
+
+  void send() {
+    if (buf.empty()) return;
+    res->chunk_write_async(buf);
+    buf.clear();
+  }
+
+  std::shared_ptr<response_t> res;
+  int flush_ms;
+  size_t flush_bytes;
+  std::string buf;  // guarded by mt
+  std::mutex mt;
+};
+
 // av_connect helper
 #define HTTP_SEND_RES_AND_RETURN(res, status, message) \
   do {                                                 \
@@ -206,15 +474,159 @@ static json json_parse(const T &data) {
 
 // llama
 
+// the types of --cache-type-k and --cache-type-v
+static const std::vector<std::string> kv_cache_types = {
+    "f32", "f16", "bf16", "q8_0", "q4_0", "q4_1", "iq4_nl", "q5_0", "q5_1"};
+
+static ggml_type kv_cache_type_from_str(const std::string &str) {
+  for (ggml_type type :
+       {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0,
+        GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_IQ4_NL, GGML_TYPE_Q5_0,
+        GGML_TYPE_Q5_1})
+    if (str == ggml_type_name(type)) return type;
+  return GGML_TYPE_F16;
+}
+
+// the KV cache of n_ctx cells of the model in bytes. an estimate: the head
+// size is taken as n_embd / n_head and every layer holds all the cells
+static size_t kv_cache_bytes(const llama_model *model, uint32_t n_ctx,
+                             ggml_type type_k, ggml_type type_v) {
+  int n_head = std::max(1, (int)llama_model_n_head(model));
+  double n_embd_kv = (double)llama_model_n_embd(model) / n_head *
+                     llama_model_n_head_kv(model);
+  double row = n_embd_kv * ((double)ggml_type_size(type_k) /
+                                ggml_blck_size(type_k) +
+                            (double)ggml_type_size(type_v) /
+                                ggml_blck_size(type_v));
+  return (size_t)(row * n_ctx * llama_model_n_layer(model));
+}
+
+static void kv_cache_print(const llama_model *model,
+                           const llama_context_params &ctx_params) {
+  AVLLM_LOG_INFO("%s: KV cache K %s, V %s, %u cells: %.1f MiB\n", __func__,
+                 ggml_type_name(ctx_params.type_k),
+                 ggml_type_name(ctx_params.type_v), ctx_params.n_ctx,
+                 kv_cache_bytes(model, ctx_params.n_ctx, ctx_params.type_k,
+                                ctx_params.type_v) /
+                     (1024.0 * 1024.0));
+}
+
 static llama_context_params llama_context_params_from_xoptions(
     const xoptions &xoptions_) {
   llama_context_params ctx_params = llama_context_default_params();
   ctx_params.no_perf = false;
   ctx_params.n_ctx = xoptions_.n_ctx;
   ctx_params.n_batch = xoptions_.n_batch;
+  ctx_params.type_k = kv_cache_type_from_str(xoptions_.cache_type_k);
+  ctx_params.type_v = kv_cache_type_from_str(xoptions_.cache_type_v);
+  // a quantized V cache needs flash attention
+  ctx_params.flash_attn =
+      xoptions_.flash_attn || ggml_is_quantized(ctx_params.type_v);
   return ctx_params;
 }
 
+// sampling options of an OpenAI-like request body over the given defaults.
+// logit_bias is {"token id or text": bias} or [[token id or text, bias]].
+// the output is constrained by a raw GBNF "grammar", else by the JSON schema
+// of "response_format" (chat), "text.format" (responses) or "json_schema"
+static av_llm::sampling_params sampling_params_from_json(
+    const json &body, const llama_vocab *vocab,
+    av_llm::sampling_params params = {}) {
+  params.temperature = json_value(body, "temperature", params.temperature);
+  params.top_k = json_value(body, "top_k", params.top_k);
+  params.top_p = json_value(body, "top_p", params.top_p);
+  params.min_p = json_value(body, "min_p", params.min_p);
+  params.penalty_last_n =
+      json_value(body, "repeat_last_n", params.penalty_last_n);
+  params.repeat_penalty =
+      json_value(body, "repeat_penalty", params.repeat_penalty);
+  params.presence_penalty =
+      json_value(body, "presence_penalty", params.presence_penalty);
+  params.frequency_penalty =
+      json_value(body, "frequency_penalty", params.frequency_penalty);
+
+  int64_t seed = json_value(body, "seed", int64_t(-1));
+  if (seed >= 0) params.seed = (uint32_t)seed;
+
+  const int n_vocab = llama_vocab_n_tokens(vocab);
+  auto add_bias = [&](const json &key, const json &value) {
+    if (!value.is_number()) return;
+    float bias = value.get<float>();
+
+    std::vector<llama_token> tokens;
+    if (key.is_number_integer()) {
+      tokens.push_back(key.get<llama_token>());
+    } else if (key.is_string()) {
+      const std::string str = key.get<std::string>();
+      char *end = nullptr;
+      long id = std::strtol(str.c_str(), &end, 10);
+      if (!str.empty() && *end == '\0')
+        tokens.push_back((llama_token)id);
+      else
+        tokens = common_tokenize(vocab, str, false);
+    }
+
+    for (llama_token token : tokens)
+      if (token >= 0 && token < n_vocab)
+        params.logit_bias.push_back({token, bias});
+  };
+
+  json logit_bias = json_value(body, "logit_bias", json());
+  if (logit_bias.is_object()) {
+    for (const auto &el : logit_bias.items()) add_bias(el.key(), el.value());
+  } else if (logit_bias.is_array()) {
+    for (const auto &el : logit_bias)
+      if (el.is_array() && el.size() == 2) add_bias(el[0], el[1]);
+  }
+
+  params.grammar = json_value(body, "grammar", params.grammar);
+  if (params.grammar.empty()) {
+    json schema = json_value(body, "json_schema", json());
+    json format = json_value(body, "response_format", json());
+    if (format.is_null() && body.contains("text") &&
+        body.at("text").is_object())
+      format = json_value(body.at("text"), "format", json());
+
+    std::string type = json_value(format, "type", std::string());
+    if (type == "json_object") {
+      schema = json_value(format, "schema", json{{"type", "object"}});
+    } else if (type == "json_schema") {
+      // chat: {"json_schema": {"schema": ...}}, responses: {"schema": ...}
+      json js = json_value(format, "json_schema", format);
+      schema = json_value(js, "schema", json{{"type", "object"}});
+    }
+    if (schema.is_object()) params.json_schema = schema.dump();
+  }
+
+  return params;
+}
+
+// the stop strings of a request: a string or an array of strings
+static std::vector<std::string> stop_strings_from_json(
+    const json &body, const std::string &key = "stop") {
+  std::vector<std::string> stops;
+  json stop = json_value(body, key, json());
+  if (stop.is_string()) {
+    stops.push_back(stop.get<std::string>());
+  } else if (stop.is_array()) {
+    for (const auto &el : stop)
+      if (el.is_string()) stops.push_back(el.get<std::string>());
+  }
+  return stops;
+}
+
+// the max generated tokens of a request, the first key present, capped by
+// the server's n_predict
+static int n_predict_from_json(const json &body,
+                               std::initializer_list<const char *> keys,
+                               int n_predict_max) {
+  for (const char *key : keys) {
+    int n = json_value(body, key, 0);
+    if (n > 0) return n_predict_max > 0 ? std::min(n, n_predict_max) : n;
+  }
+  return n_predict_max;
+}
+
 static void llama_sampler_print(const llama_sampler *smpl) {
   int n_samplers = llama_sampler_chain_n(smpl);
   for (int i = 0; i < n_samplers; i++) {
@@ -0,0 +1,77 @@
+#include "catch2/catch.hpp"
+
+#include "../src/detokenizer.hpp"
+
+#include <string>
+#include <vector>
+
+using av_llm::detokenizer;
+using av_llm::piece_table;
+
+TEST_CASE("detokenizer_complete_len")
+{
+    // ascii and complete characters
+    REQUIRE(detokenizer::complete_len("") == 0);
+    REQUIRE(detokenizer::complete_len("abc") == 3);
+    REQUIRE(detokenizer::complete_len("a\xc3\xa9") == 3);
+    REQUIRE(detokenizer::complete_len("\xf0\x9f\x98\x80") == 4);
+
+    // the start of a character is held back
+    REQUIRE(detokenizer::complete_len("a\xc3") == 1);
+    REQUIRE(detokenizer::complete_len("a\xe2\x82") == 1);
+    REQUIRE(detokenizer::complete_len("a\xf0\x9f\x98") == 1);
+
+    // invalid bytes are not held back
+    REQUIRE(detokenizer::complete_len("\xc3" "A") == 2);
+    REQUIRE(detokenizer::complete_len("a\x80\x80\x80") == 4);
+    REQUIRE(detokenizer::complete_len("\xff") == 1);
+}
+
+TEST_CASE("detokenizer_split_codepoint")
+{
+    // "é" (c3 a9) split across two tokens
+    piece_table table({"a\xc3", "\xa9" "b", "c"});
+    detokenizer detok(&table);
+
+    REQUIRE(detok.push(0) == "a");
+    REQUIRE(detok.push(1) == "\xc3\xa9" "b");
+    REQUIRE(detok.push(2) == "c");
+    REQUIRE(detok.flush().empty());
+}
+
+TEST_CASE("detokenizer_invalid_continuation")
+{
+    // a lead byte followed by a byte that doesn't continue it
+    piece_table table({"x\xc3", "A", "\x80"});
+    detokenizer detok(&table);
+
+    REQUIRE(detok.push(0) == "x");
+    REQUIRE(detok.push(1) == "\xc3" "A");
+    REQUIRE(detok.push(2) == "\x80");
+    REQUIRE(detok.flush().empty());
+}
+
+TEST_CASE("detokenizer_4byte_at_end")
+{
+    // "😀" (f0 9f 98 80) one byte per token
+    piece_table table({"\xf0", "\x9f", "\x98", "\x80"});
+
+    SECTION("complete at the last token")
+    {
+        detokenizer detok(&table);
+        REQUIRE(detok.push(0).empty());
+        REQUIRE(detok.push(1).empty());
+        REQUIRE(detok.push(2).empty());
+        REQUIRE(detok.push(3) == "\xf0\x9f\x98\x80");
+        REQUIRE(detok.flush().empty());
+    }
+
+    SECTION("cut by the end of the stream")
+    {
+        detokenizer detok(&table);
+        REQUIRE(detok.push(0).empty());
+        REQUIRE(detok.push(1).empty());
+        REQUIRE(detok.push(2).empty());
+        REQUIRE(detok.flush() == "\xf0\x9f\x98");
+    }
+}
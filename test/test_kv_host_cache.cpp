@@ -0,0 +1,120 @@
+#include "catch2/catch.hpp"
+
+#include "../src/kv_host_cache.hpp"
+
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+using av_llm::kv_host_cache;
+
+// n tokens counting from first
+static std::vector<llama_token> make_tokens(size_t n, llama_token first = 0)
+{
+    std::vector<llama_token> tokens(n);
+    std::iota(tokens.begin(), tokens.end(), first);
+    return tokens;
+}
+
+TEST_CASE("kv_host_cache_block_prefix")
+{
+    kv_host_cache cache(1 << 20, 4);
+    std::vector<llama_token> cached = make_tokens(12);  // 3 blocks
+    cache.put(cached, std::vector<uint8_t>(100, 1));
+
+    SECTION("the whole entry")
+    {
+        auto [n, state] = cache.find(make_tokens(20), 20);
+        REQUIRE(n == 12);
+        REQUIRE(state != nullptr);
+        REQUIRE(state->size() == 100);
+    }
+
+    SECTION("a prompt sharing the first blocks")
+    {
+        std::vector<llama_token> prompt = make_tokens(10);
+        prompt.push_back(1000);  // differs in the third block
+        prompt.push_back(1001);
+        auto [n, state] = cache.find(prompt, prompt.size());
+        REQUIRE(n == 8);
+        REQUIRE(state != nullptr);
+    }
+
+    SECTION("bounded by n_max")
+    {
+        REQUIRE(cache.find(make_tokens(20), 11).first == 8);
+        REQUIRE(cache.find(make_tokens(20), 3).first == 0);
+    }
+
+    SECTION("a prompt shorter than one block")
+    {
+        auto [n, state] = cache.find(make_tokens(3), 3);
+        REQUIRE(n == 0);
+        REQUIRE(state == nullptr);
+    }
+
+    SECTION("a prompt differing in the first block")
+    {
+        std::vector<llama_token> prompt = make_tokens(12);
+        prompt[1]                       = 1000;
+        REQUIRE(cache.find(prompt, prompt.size()).first == 0);
+    }
+
+    SECTION("contains")
+    {
+        REQUIRE(cache.contains(cached, 12));
+        REQUIRE(cache.contains(cached, 4));
+        REQUIRE(!cache.contains(make_tokens(12, 1), 12));
+    }
+}
+
+TEST_CASE("kv_host_cache_short_entry")
+{
+    // less than one block is not stored
+    kv_host_cache cache(1 << 20, 4);
+    cache.put(make_tokens(3), std::vector<uint8_t>(10));
+    REQUIRE(cache.size_bytes() == 0);
+    REQUIRE(cache.find(make_tokens(3), 3).first == 0);
+}
+
+TEST_CASE("kv_host_cache_lru_capacity")
+{
+    // an entry of one block and 100 bytes of state takes 116 bytes
+    const size_t entry_size = 100 + 4 * sizeof(llama_token);
+    kv_host_cache cache(2 * entry_size, 4);
+
+    std::vector<llama_token> a = make_tokens(4, 0);
+    std::vector<llama_token> b = make_tokens(4, 100);
+    std::vector<llama_token> c = make_tokens(4, 200);
+
+    cache.put(a, std::vector<uint8_t>(100));
+    cache.put(b, std::vector<uint8_t>(100));
+    REQUIRE(cache.size_bytes() == 2 * entry_size);
+
+    SECTION("the least recently used entry goes first")
+    {
+        REQUIRE(cache.find(a, 4).first == 4);  // a is used last
+        cache.put(c, std::vector<uint8_t>(100));
+
+        REQUIRE(cache.size_bytes() == 2 * entry_size);
+        REQUIRE(cache.contains(a, 4));
+        REQUIRE(!cache.contains(b, 4));
+        REQUIRE(cache.contains(c, 4));
+    }
+
+    SECTION("an entry larger than the capacity is not stored")
+    {
+        cache.put(c, std::vector<uint8_t>(3 * entry_size));
+        REQUIRE(!cache.contains(c, 4));
+        REQUIRE(cache.contains(a, 4));
+        REQUIRE(cache.contains(b, 4));
+    }
+
+    SECTION("a large entry evicts several")
+    {
+        cache.put(c, std::vector<uint8_t>(entry_size + 50));
+        REQUIRE(cache.contains(c, 4));
+        REQUIRE(!cache.contains(a, 4));
+        REQUIRE(!cache.contains(b, 4));
+    }
+}
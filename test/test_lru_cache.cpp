@@ -0,0 +1,58 @@
+#include "catch2/catch.hpp"
+
+#include "../src/lru_cache.hpp"
+
+#include <string>
+#include <vector>
+
+using av_llm::lru_cache;
+
+TEST_CASE("lru_cache_entries")
+{
+    lru_cache<int, std::string> cache(2);
+    cache.put(1, "a");
+    cache.put(2, "b");
+
+    REQUIRE(cache.get(1) != nullptr);  // 2 is the least recently used now
+    cache.put(3, "c");
+
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.contains(1));
+    REQUIRE(!cache.contains(2));
+    REQUIRE(*cache.get(3) == "c");
+    REQUIRE(cache.get(2) == nullptr);
+}
+
+TEST_CASE("lru_cache_cost")
+{
+    std::vector<int> evicted;
+    lru_cache<int, std::string> cache(
+        10, [](const std::string &s) { return s.size(); }, [&evicted](int key, const std::string &) { evicted.push_back(key); });
+
+    cache.put(1, "aaaa");
+    cache.put(2, "bbbb");
+    cache.put(3, "cc");
+    REQUIRE(cache.used_capacity() == 10);
+
+    SECTION("the least recently used entries make room")
+    {
+        cache.put(4, "dddddd");
+        REQUIRE(evicted == std::vector<int>{1, 2});
+        REQUIRE(cache.used_capacity() == 8);
+    }
+
+    SECTION("a value larger than the capacity is not stored")
+    {
+        REQUIRE(cache.put(4, std::string(11, 'd')) == nullptr);
+        REQUIRE(!cache.contains(4));
+        REQUIRE(cache.used_capacity() == 10);
+    }
+
+    SECTION("a replaced value leaves the cache")
+    {
+        cache.put(1, "a");
+        REQUIRE(evicted == std::vector<int>{1});
+        REQUIRE(*cache.get(1) == "a");
+        REQUIRE(cache.used_capacity() == 7);
+    }
+}
@@ -29,3 +29,144 @@ TEST_CASE("test_model_printf")
     std::cout << std::endl;
 }
 #endif
+
+#include "catch2/catch.hpp"
+
+#include "ggml-backend.h"
+#include "llama.h"
+
+#include "../src/chat_prompt.hpp"
+#include "../src/token_cache.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// the vocab of the test model, loaded once. nullptr when the model file is missing
+static const llama_vocab * test_vocab()
+{
+    static llama_model * model = []() -> llama_model * {
+        std::filesystem::path model_path("../../../model/qwen2.5-coder-3b-instruct-q8_0.gguf");
+        if (not std::filesystem::is_regular_file(model_path))
+            return nullptr;
+
+        ggml_backend_load_all();
+        llama_model_params model_params = llama_model_default_params();
+        model_params.vocab_only         = true;
+        return llama_model_load_from_file(model_path.generic_string().c_str(), model_params);
+    }();
+    return model ? llama_model_get_vocab(model) : nullptr;
+}
+
+TEST_CASE("chat_prompt_cache_reuse")
+{
+    const llama_vocab * vocab = test_vocab();
+    if (nullptr == vocab)
+    {
+        INFO("the test model is not existed");
+        REQUIRE(false);
+    }
+
+    using json = nlohmann::ordered_json;
+    av_llm::chat_prompt_cache cache;
+
+    json msgs = json::array({{{"role", "system"}, {"content", "You are a helpful assistant."}},
+                             {{"role", "user"}, {"content", "Write a haiku."}}});
+    std::string head   = "<|im_start|>system\nYou are a helpful assistant.<|im_end|>\n";
+    std::string prompt = head + "<|im_start|>user\nWrite a haiku.<|im_end|>\n<|im_start|>assistant\n";
+
+    auto render_head = [&head]() { return head; };
+    size_t n_cached  = 0;
+    auto tokens      = cache.tokenize(vocab, prompt, av_llm::chat_prompt_cache::prefix_hashes(msgs, ""), render_head, &n_cached);
+    REQUIRE(tokens == av_llm::tokenize_text(vocab, prompt, true, true));
+    REQUIRE(n_cached > 0);  // the system prompt, rendered alone
+
+    SECTION("an appended turn")
+    {
+        msgs.push_back({{"role", "assistant"}, {"content", "Autumn moonlight"}});
+        msgs.push_back({{"role", "user"}, {"content", "Another one."}});
+        std::string next = prompt + "Autumn moonlight<|im_end|>\n<|im_start|>user\nAnother one.<|im_end|>\n"
+                                    "<|im_start|>assistant\n";
+
+        auto next_tokens = cache.tokenize(vocab, next, av_llm::chat_prompt_cache::prefix_hashes(msgs, ""), render_head, &n_cached);
+        REQUIRE(next_tokens == av_llm::tokenize_text(vocab, next, true, true));
+        // the previous prompt up to its last <|im_start|>, "assistant\n" is tokenized again
+        REQUIRE(n_cached > 0);
+        REQUIRE(n_cached < tokens.size());
+        REQUIRE(n_cached + 4 > tokens.size());
+    }
+
+    SECTION("a new conversation with the same system prompt")
+    {
+        json other             = json::array({msgs[0], {{"role", "user"}, {"content", "Hi"}}});
+        std::string other_text = head + "<|im_start|>user\nHi<|im_end|>\n<|im_start|>assistant\n";
+
+        auto other_tokens = cache.tokenize(vocab, other_text, av_llm::chat_prompt_cache::prefix_hashes(other, ""), render_head, &n_cached);
+        REQUIRE(other_tokens == av_llm::tokenize_text(vocab, other_text, true, true));
+        REQUIRE(n_cached > 0);
+    }
+
+    SECTION("a split without a special token")
+    {
+        // the cached text ends inside a word: the whole prompt is tokenized
+        json partial       = json::array({{{"role", "user"}, {"content", "token"}}});
+        std::string text   = "<|im_start|>user\ntoken";
+        std::string longer = text + "izer<|im_end|>\n";
+        cache.tokenize(vocab, text, av_llm::chat_prompt_cache::prefix_hashes(partial, ""));
+
+        partial.push_back({{"role", "user"}, {"content", "izer"}});
+        auto longer_tokens = cache.tokenize(vocab, longer, av_llm::chat_prompt_cache::prefix_hashes(partial, ""), nullptr, &n_cached);
+        REQUIRE(longer_tokens == av_llm::tokenize_text(vocab, longer, true, true));
+        REQUIRE(n_cached == 1);  // <|im_start|>
+    }
+}
+
+TEST_CASE("token_cache_lru")
+{
+    const llama_vocab * vocab = test_vocab();
+    if (nullptr == vocab)
+    {
+        INFO("the test model is not existed");
+        REQUIRE(false);
+    }
+
+    // two entries, texts of 8 bytes and more
+    av_llm::token_cache cache(2, 8);
+    std::string a = "int main() { return 0; }";
+    std::string b = "def main():\n    return 0\n";
+    std::string c = "fn main() -> i32 { 0 }";
+
+    SECTION("miss then hit")
+    {
+        REQUIRE(!cache.contains(a, true, true));
+        auto tokens = cache.tokenize(vocab, a, true, true);
+        REQUIRE(tokens == av_llm::tokenize_text(vocab, a, true, true));
+        REQUIRE(cache.contains(a, true, true));
+        REQUIRE(cache.tokenize(vocab, a, true, true) == tokens);
+
+        // the options are part of the key
+        REQUIRE(!cache.contains(a, false, true));
+        REQUIRE(cache.tokenize(vocab, a, false, true) == av_llm::tokenize_text(vocab, a, false, true));
+    }
+
+    SECTION("short texts are not cached")
+    {
+        auto tokens = cache.tokenize(vocab, "hi", true, true);
+        REQUIRE(tokens == av_llm::tokenize_text(vocab, "hi", true, true));
+        REQUIRE(!cache.contains("hi", true, true));
+    }
+
+    SECTION("the least recently used entry is evicted")
+    {
+        cache.tokenize(vocab, a, true, true);
+        cache.tokenize(vocab, b, true, true);
+        cache.tokenize(vocab, a, true, true);  // a is used last
+        cache.tokenize(vocab, c, true, true);
+
+        REQUIRE(cache.contains(a, true, true));
+        REQUIRE(!cache.contains(b, true, true));
+        REQUIRE(cache.contains(c, true, true));
+    }
+}
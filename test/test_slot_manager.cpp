@@ -0,0 +1,66 @@
+#include "catch2/catch.hpp"
+
+#include "../src/scheduler.hpp"
+
+#include <vector>
+
+using av_llm::slot_manager;
+
+TEST_CASE("slot_manager_session_affinity")
+{
+    slot_manager slots(1);
+    std::vector<llama_token> prompt = {1, 2, 3};
+    bool is_session_hit             = false;
+
+    int slot_id = slots.acquire(prompt, "x", &is_session_hit);
+    REQUIRE(!is_session_hit);
+    slots.tokens(slot_id) = prompt;
+    slots.release(slot_id);
+
+    SECTION("the session comes back to its slot")
+    {
+        REQUIRE(slots.acquire({}, "x", &is_session_hit) == slot_id);
+        REQUIRE(is_session_hit);
+    }
+
+    SECTION("an anonymous request in between clears the tag")
+    {
+        REQUIRE(slots.acquire(prompt, "", &is_session_hit) == slot_id);
+        REQUIRE(!is_session_hit);
+        slots.tokens(slot_id) = {7, 8, 9};
+        slots.release(slot_id);
+
+        // the KV is no longer the session's, nothing to append to
+        REQUIRE(slots.acquire({}, "x", &is_session_hit) == slot_id);
+        REQUIRE(!is_session_hit);
+    }
+
+    SECTION("another session in between takes the tag")
+    {
+        REQUIRE(slots.acquire({}, "y", &is_session_hit) == slot_id);
+        slots.release(slot_id);
+        REQUIRE(slots.acquire({}, "x", &is_session_hit) == slot_id);
+        REQUIRE(!is_session_hit);
+    }
+}
+
+TEST_CASE("slot_manager_dropped_slot_first")
+{
+    slot_manager slots(2);
+    bool is_session_hit = false;
+
+    int a = slots.acquire({1, 2}, "", &is_session_hit);
+    int b = slots.acquire({3, 4}, "", &is_session_hit);
+    slots.tokens(a) = {1, 2};
+    slots.tokens(b) = {3, 4};
+    slots.release(a);
+    slots.release(b);
+
+    // the KV of the least recently used slot is dropped to make room
+    REQUIRE(slots.acquire_idle() == a);
+    slots.tokens(a).clear();
+    slots.release(a, false);
+
+    // a new prompt takes the empty slot, b keeps its prefix
+    REQUIRE(slots.acquire({5, 6}, "", &is_session_hit) == a);
+}
@@ -0,0 +1,114 @@
+#include "catch2/catch.hpp"
+
+#include "../src/stop_matcher.hpp"
+
+#include <string>
+#include <vector>
+
+using av_llm::stop_matcher;
+
+// push the pieces, return the emitted text and whether a stop was found
+static std::string push_all(stop_matcher & stops, const std::vector<std::string> & pieces, bool * is_found)
+{
+    std::string text;
+    *is_found = false;
+    for (const auto & piece : pieces)
+    {
+        text += stops.push(piece, is_found);
+        if (*is_found)
+            break;
+    }
+    return text;
+}
+
+TEST_CASE("stop_matcher_no_stop")
+{
+    stop_matcher stops;
+    REQUIRE(stops.empty());
+
+    bool is_found = false;
+    REQUIRE(stops.push("hello", &is_found) == "hello");
+    REQUIRE(!is_found);
+    REQUIRE(stops.flush().empty());
+
+    // empty stop strings are ignored
+    stop_matcher empty({""});
+    REQUIRE(empty.empty());
+}
+
+TEST_CASE("stop_matcher_split_across_pushes")
+{
+    stop_matcher stops({"</end>"});
+    bool is_found = false;
+
+    REQUIRE(stops.push("abc</", &is_found) == "abc");
+    REQUIRE(!is_found);
+    REQUIRE(stops.push("en", &is_found).empty());
+    REQUIRE(!is_found);
+    REQUIRE(stops.push("d>tail", &is_found).empty());
+    REQUIRE(is_found);
+}
+
+TEST_CASE("stop_matcher_held_text_released")
+{
+    stop_matcher stops({"</end>"});
+    bool is_found = false;
+
+    // the held "</e" turns out not to be the stop string
+    REQUIRE(stops.push("x</e", &is_found) == "x");
+    REQUIRE(stops.push("nx", &is_found) == "</enx");
+    REQUIRE(!is_found);
+}
+
+TEST_CASE("stop_matcher_overlapping_stops")
+{
+    SECTION("the earliest stop wins")
+    {
+        stop_matcher stops({"bcd", "ab"});
+        bool is_found = false;
+        REQUIRE(push_all(stops, {"xabcd"}, &is_found) == "x");
+        REQUIRE(is_found);
+    }
+
+    SECTION("a stop inside the held prefix of another")
+    {
+        stop_matcher stops({"abcd", "bc"});
+        bool is_found = false;
+        REQUIRE(push_all(stops, {"a", "b", "c"}, &is_found) == "a");
+        REQUIRE(is_found);
+    }
+
+    SECTION("the longest partial match is held")
+    {
+        stop_matcher stops({"ab", "aab"});
+        bool is_found = false;
+        REQUIRE(stops.push("xaa", &is_found) == "x");
+        REQUIRE(!is_found);
+        REQUIRE(stops.push("b", &is_found).empty());  // "aab" starts first
+        REQUIRE(is_found);
+    }
+}
+
+TEST_CASE("stop_matcher_inclusive")
+{
+    stop_matcher exclusive({"STOP"}, false);
+    stop_matcher inclusive({"STOP"}, true);
+    bool is_found = false;
+
+    REQUIRE(push_all(exclusive, {"go ST", "OP now"}, &is_found) == "go ");
+    REQUIRE(is_found);
+    REQUIRE(push_all(inclusive, {"go ST", "OP now"}, &is_found) == "go STOP");
+    REQUIRE(is_found);
+}
+
+TEST_CASE("stop_matcher_flush_at_eog")
+{
+    stop_matcher stops({"</end>"});
+    bool is_found = false;
+
+    // the generation ends with a partial stop string: it is text
+    REQUIRE(stops.push("done </en", &is_found) == "done ");
+    REQUIRE(!is_found);
+    REQUIRE(stops.flush() == "</en");
+    REQUIRE(stops.flush().empty());
+}